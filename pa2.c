@@ -1,78 +1,737 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL 1
+#endif
 
 #define SAMPLES 10000
 #define RUNS 50000
 #define BINS 64
 #define HISTOGRAM_SPAN 0.05
 #define SCALE 32
+#define MAX_BINS 1024
+#define MAX_BAR 64
+#define PILOT_RUNS 1024
+#define SPAN_SIGMAS 8.0
+#define DIST_SPEC_LEN 256
+#define TEST_SEED 1
+#define RUN_BLOCK 256
+#define MAX_THREADS 256
+#define SIMD_BLOCKS 8
+#define SIMD_TOLERANCE ((double)config.samples * 0x1p-52)
+
+/*
+ * Philox4x32-10 counter-based generator (Salmon et al., SC'11).
+ * Every draw is a pure function of (seed, stream, position), so a stream can
+ * start anywhere without stepping through the draws before it, and each run
+ * gets its own stream that no other run can overlap.
+ */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+typedef struct {
+    uint32_t key[2];
+    uint64_t stream;
+    uint64_t block;
+    uint64_t spare;
+    int has_spare;
+} RngStream;
+
+/*
+ * Run-time settings. SAMPLES, RUNS, BINS, HISTOGRAM_SPAN and SCALE are the
+ * defaults; a span or scale of 0 is derived at run time instead.
+ */
+typedef struct {
+    int samples;
+    uint64_t runs;
+    int bins;
+    double span;
+    double center;
+    uint64_t scale;
+    char distribution[DIST_SPEC_LEN];
+} Config;
+
+static Config config = {SAMPLES, RUNS, BINS, HISTOGRAM_SPAN, 0.0, SCALE, "uniform"};
+
+static inline void philox_block(const uint32_t key[2], const uint32_t ctr[4], uint64_t out[2]) {
+
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    uint32_t k0 = key[0], k1 = key[1];
+
+    for (int round = 0; round < PHILOX_ROUNDS; round++) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t)p1;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    out[0] = ((uint64_t)c1 << 32) | c0;
+    out[1] = ((uint64_t)c3 << 32) | c2;
+}
+
+/* Returns the next two draws of the stream as one Philox block. */
+static inline void rng_next_pair(RngStream *rng, uint64_t out[2]) {
+
+    uint32_t ctr[4] = {(uint32_t)rng->block, (uint32_t)(rng->block >> 32),
+                       (uint32_t)rng->stream, (uint32_t)(rng->stream >> 32)};
+    philox_block(rng->key, ctr, out);
+    rng->block++;
+}
+
+/* Positions a stream at the first draw of stream number `stream`. */
+void rng_init(RngStream *rng, uint64_t seed, uint64_t stream) {
+
+    rng->key[0] = (uint32_t)seed;
+    rng->key[1] = (uint32_t)(seed >> 32);
+    rng->stream = stream;
+    rng->block = 0;
+    rng->has_spare = 0;
+}
+
+uint64_t rng_next64(RngStream *rng) {
+
+    if (rng->has_spare) {
+        rng->has_spare = 0;
+        return rng->spare;
+    }
+
+    uint64_t pair[2];
+    rng_next_pair(rng, pair);
+    rng->spare = pair[1];
+    rng->has_spare = 1;
+
+    return pair[0];
+}
+
+/*
+ * Maps the top 52 bits to a double in [1, 2) by supplying the exponent
+ * directly, then to [-1, 1) with an exact multiply and subtract.
+ */
+double uniform_from_bits(uint64_t bits) {
+
+    uint64_t pattern = (bits >> 12) | UINT64_C(0x3FF0000000000000);
+    double one_to_two;
+    memcpy(&one_to_two, &pattern, sizeof(one_to_two));
+
+    return one_to_two * 2.0 - 3.0;
+}
+
+double get_mean_of_uniform_random_samples(RngStream *rng) {
+
+    double sum = 0.0;
+    int i = 0;
+
+    if (!rng->has_spare) {
+        for (; i + 1 < config.samples; i += 2) {
+            uint64_t pair[2];
+            rng_next_pair(rng, pair);
+            sum += uniform_from_bits(pair[0]);
+            sum += uniform_from_bits(pair[1]);
+        }
+    }
+    for (; i < config.samples; i++) {
+        sum += uniform_from_bits(rng_next64(rng));
+    }
+
+    return sum / config.samples;
+}
+
+/*
+ * Non-uniform distributions.
+ * Normal and exponential draws use the Marsaglia-Tsang Ziggurat: one 64-bit
+ * draw picks a layer from its low bits and a candidate from its high 32
+ * bits, and about 99% of candidates are accepted with one table compare and
+ * one multiply. Discrete distributions use Vose's alias table, which costs
+ * one draw and one compare per sample for any number of outcomes.
+ */
+#define ZIG_NORMAL_LAYERS 128
+#define ZIG_NORMAL_R 3.442619855899
+#define ZIG_NORMAL_V 9.91256303526217e-3
+#define ZIG_EXP_LAYERS 256
+#define ZIG_EXP_R 7.697117470131487
+#define ZIG_EXP_V 3.949659822581572e-3
+#define MAX_OUTCOMES 256
+
+typedef enum {
+    DIST_UNIFORM,
+    DIST_NORMAL,
+    DIST_EXPONENTIAL,
+    DIST_DISCRETE
+} DistributionKind;
+
+typedef struct {
+    DistributionKind kind;
+    double mean;
+    double variance;
+    int outcomes;
+    double accept[MAX_OUTCOMES];
+    int alias[MAX_OUTCOMES];
+} Distribution;
+
+static Distribution distribution = {DIST_UNIFORM, 0.0, 1.0 / 3.0, 0, {0.0}, {0}};
+
+static uint32_t zig_normal_k[ZIG_NORMAL_LAYERS];
+static double zig_normal_w[ZIG_NORMAL_LAYERS];
+static double zig_normal_f[ZIG_NORMAL_LAYERS];
+static uint32_t zig_exp_k[ZIG_EXP_LAYERS];
+static double zig_exp_w[ZIG_EXP_LAYERS];
+static double zig_exp_f[ZIG_EXP_LAYERS];
+
+void build_ziggurat_tables(void) {
+
+    const double m1 = 2147483648.0, m2 = 4294967296.0;
+    double dn = ZIG_NORMAL_R, tn = dn;
+    double q = ZIG_NORMAL_V / exp(-0.5 * dn * dn);
+
+    zig_normal_k[0] = (uint32_t)((dn / q) * m1);
+    zig_normal_k[1] = 0;
+    zig_normal_w[0] = q / m1;
+    zig_normal_w[ZIG_NORMAL_LAYERS - 1] = dn / m1;
+    zig_normal_f[0] = 1.0;
+    zig_normal_f[ZIG_NORMAL_LAYERS - 1] = exp(-0.5 * dn * dn);
+    for (int i = ZIG_NORMAL_LAYERS - 2; i >= 1; i--) {
+        dn = sqrt(-2.0 * log(ZIG_NORMAL_V / dn + exp(-0.5 * dn * dn)));
+        zig_normal_k[i + 1] = (uint32_t)((dn / tn) * m1);
+        tn = dn;
+        zig_normal_f[i] = exp(-0.5 * dn * dn);
+        zig_normal_w[i] = dn / m1;
+    }
+
+    double de = ZIG_EXP_R, te = de;
+    q = ZIG_EXP_V / exp(-de);
+
+    zig_exp_k[0] = (uint32_t)((de / q) * m2);
+    zig_exp_k[1] = 0;
+    zig_exp_w[0] = q / m2;
+    zig_exp_w[ZIG_EXP_LAYERS - 1] = de / m2;
+    zig_exp_f[0] = 1.0;
+    zig_exp_f[ZIG_EXP_LAYERS - 1] = exp(-de);
+    for (int i = ZIG_EXP_LAYERS - 2; i >= 1; i--) {
+        de = -log(ZIG_EXP_V / de + exp(-de));
+        zig_exp_k[i + 1] = (uint32_t)((de / te) * m2);
+        te = de;
+        zig_exp_f[i] = exp(-de);
+        zig_exp_w[i] = de / m2;
+    }
+}
+
+/* A double in (0, 1), never 0, for the logarithms in the slow paths. */
+static inline double open_unit_from_bits(uint64_t bits) {
+
+    return ((double)(bits >> 11) + 0.5) * 0x1p-53;
+}
+
+static double normal_slow_path(RngStream *rng, int32_t hz, int iz) {
+
+    for (;;) {
+        double x = hz * zig_normal_w[iz];
+
+        if (iz == 0) {
+            double y;
+            do {
+                x = -log(open_unit_from_bits(rng_next64(rng))) / ZIG_NORMAL_R;
+                y = -log(open_unit_from_bits(rng_next64(rng)));
+            } while (y + y < x * x);
+            return hz > 0 ? ZIG_NORMAL_R + x : -ZIG_NORMAL_R - x;
+        }
+        double f = zig_normal_f[iz] + open_unit_from_bits(rng_next64(rng)) * (zig_normal_f[iz - 1] - zig_normal_f[iz]);
+        if (f < exp(-0.5 * x * x)) {
+            return x;
+        }
+
+        uint64_t bits = rng_next64(rng);
+        hz = (int32_t)(uint32_t)(bits >> 32);
+        iz = (int)(bits & (ZIG_NORMAL_LAYERS - 1));
+        if ((uint32_t)(hz < 0 ? -(int64_t)hz : hz) < zig_normal_k[iz]) {
+            return hz * zig_normal_w[iz];
+        }
+    }
+}
+
+static inline double normal_from_rng(RngStream *rng) {
+
+    uint64_t bits = rng_next64(rng);
+    int32_t hz = (int32_t)(uint32_t)(bits >> 32);
+    int iz = (int)(bits & (ZIG_NORMAL_LAYERS - 1));
+
+    if ((uint32_t)(hz < 0 ? -(int64_t)hz : hz) < zig_normal_k[iz]) {
+        return hz * zig_normal_w[iz];
+    }
+
+    return normal_slow_path(rng, hz, iz);
+}
+
+static double exponential_slow_path(RngStream *rng, uint32_t jz, int iz) {
+
+    for (;;) {
+        if (iz == 0) {
+            return ZIG_EXP_R - log(open_unit_from_bits(rng_next64(rng)));
+        }
+        double x = jz * zig_exp_w[iz];
+        double f = zig_exp_f[iz] + open_unit_from_bits(rng_next64(rng)) * (zig_exp_f[iz - 1] - zig_exp_f[iz]);
+        if (f < exp(-x)) {
+            return x;
+        }
+
+        uint64_t bits = rng_next64(rng);
+        jz = (uint32_t)(bits >> 32);
+        iz = (int)(bits & (ZIG_EXP_LAYERS - 1));
+        if (jz < zig_exp_k[iz]) {
+            return jz * zig_exp_w[iz];
+        }
+    }
+}
+
+static inline double exponential_from_rng(RngStream *rng) {
+
+    uint64_t bits = rng_next64(rng);
+    uint32_t jz = (uint32_t)(bits >> 32);
+    int iz = (int)(bits & (ZIG_EXP_LAYERS - 1));
+
+    if (jz < zig_exp_k[iz]) {
+        return jz * zig_exp_w[iz];
+    }
+
+    return exponential_slow_path(rng, jz, iz);
+}
+
+/* Outcome k of a discrete distribution; the value drawn is k itself. */
+static inline double discrete_from_rng(RngStream *rng) {
+
+    uint64_t bits = rng_next64(rng);
+    int column = (int)(((bits >> 32) * (uint64_t)distribution.outcomes) >> 32);
+    double coin = (double)(uint32_t)bits * 0x1p-32;
+
+    return coin < distribution.accept[column] ? column : distribution.alias[column];
+}
+
+/* Vose's alias method over weights[0..outcomes). */
+int build_alias_table(const double *weights, int outcomes) {
+
+    double total = 0.0, scaled[MAX_OUTCOMES];
+    int small[MAX_OUTCOMES], large[MAX_OUTCOMES];
+    int num_small = 0, num_large = 0;
+
+    for (int k = 0; k < outcomes; k++) {
+        if (weights[k] < 0.0) {
+            return -1;
+        }
+        total += weights[k];
+    }
+    if (total <= 0.0) {
+        return -1;
+    }
 
-double get_mean_of_uniform_random_samples(void) {
+    distribution.outcomes = outcomes;
+    distribution.mean = 0.0;
+    distribution.variance = 0.0;
+    for (int k = 0; k < outcomes; k++) {
+        double p = weights[k] / total;
+        distribution.mean += k * p;
+        distribution.variance += (double)k * k * p;
+        scaled[k] = p * outcomes;
+        if (scaled[k] < 1.0) {
+            small[num_small++] = k;
+        } else {
+            large[num_large++] = k;
+        }
+    }
+    distribution.variance -= distribution.mean * distribution.mean;
+
+    while (num_small > 0 && num_large > 0) {
+        int s = small[--num_small], l = large[--num_large];
+        distribution.accept[s] = scaled[s];
+        distribution.alias[s] = l;
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            small[num_small++] = l;
+        } else {
+            large[num_large++] = l;
+        }
+    }
+    while (num_large > 0) {
+        int l = large[--num_large];
+        distribution.accept[l] = 1.0;
+        distribution.alias[l] = l;
+    }
+    while (num_small > 0) {
+        int s = small[--num_small];
+        distribution.accept[s] = 1.0;
+        distribution.alias[s] = s;
+    }
+
+    return 0;
+}
+
+/* Parses "uniform", "normal", "exponential" or "discrete:w0,w1,...". */
+int select_distribution(const char *spec) {
+
+    if (strlen(spec) >= DIST_SPEC_LEN) {
+        fprintf(stderr, "Error: distribution %s is too long.\n", spec);
+        return -1;
+    }
+
+    if (strcmp(spec, "uniform") == 0) {
+        distribution.kind = DIST_UNIFORM;
+        distribution.mean = 0.0;
+        distribution.variance = 1.0 / 3.0;
+    } else if (strcmp(spec, "normal") == 0) {
+        distribution.kind = DIST_NORMAL;
+        distribution.mean = 0.0;
+        distribution.variance = 1.0;
+    } else if (strcmp(spec, "exponential") == 0) {
+        distribution.kind = DIST_EXPONENTIAL;
+        distribution.mean = 1.0;
+        distribution.variance = 1.0;
+    } else if (strncmp(spec, "discrete:", 9) == 0) {
+        double weights[MAX_OUTCOMES];
+        int outcomes = 0;
+        const char *p = spec + 9;
+        char *end;
+
+        while (*p != '\0' && outcomes < MAX_OUTCOMES) {
+            weights[outcomes++] = strtod(p, &end);
+            if (end == p || (*end != ',' && *end != '\0')) {
+                outcomes = 0;
+                break;
+            }
+            p = *end == ',' ? end + 1 : end;
+        }
+        if (outcomes == 0 || *p != '\0' || build_alias_table(weights, outcomes) != 0) {
+            fprintf(stderr, "Error: bad discrete weights in %s.\n", spec);
+            return -1;
+        }
+        distribution.kind = DIST_DISCRETE;
+    } else {
+        fprintf(stderr, "Error: unknown distribution %s.\n", spec);
+        return -1;
+    }
+
+    strcpy(config.distribution, spec);
+    config.center = distribution.mean;
+
+    return 0;
+}
+
+double get_mean_of_distribution_samples(RngStream *rng) {
+
+    double sum = 0.0;
+
+    switch (distribution.kind) {
+    case DIST_NORMAL:
+        for (int i = 0; i < config.samples; i++) {
+            sum += normal_from_rng(rng);
+        }
+        break;
+    case DIST_EXPONENTIAL:
+        for (int i = 0; i < config.samples; i++) {
+            sum += exponential_from_rng(rng);
+        }
+        break;
+    case DIST_DISCRETE:
+        for (int i = 0; i < config.samples; i++) {
+            sum += discrete_from_rng(rng);
+        }
+        break;
+    default:
+        return get_mean_of_uniform_random_samples(rng);
+    }
+
+    return sum / config.samples;
+}
+
+#ifdef HAVE_AVX2_KERNEL
+/* Low and high 32-bit halves of the eight 32x32-bit products m * x. */
+__attribute__((target("avx2")))
+static inline void mul_hi_lo_avx2(__m256i x, __m256i m, __m256i *hi, __m256i *lo) {
+
+    __m256i even = _mm256_mul_epu32(x, m);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), m);
+
+    *hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+    *lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+}
+
+/* [-1, 1) from four 64-bit draws, using the same bits as uniform_from_bits. */
+__attribute__((target("avx2")))
+static inline __m256d uniform_from_bits_avx2(__m256i bits) {
+
+    const __m256i exponent = _mm256_set1_epi64x(0x3FF0000000000000LL);
+    __m256d one_to_two = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 12), exponent));
+
+    return _mm256_sub_pd(_mm256_mul_pd(one_to_two, _mm256_set1_pd(2.0)), _mm256_set1_pd(3.0));
+}
+
+/*
+ * Philox with one block per 32-bit lane: each call produces the same 16
+ * draws as eight rng_next_pair calls, summed into four accumulators.
+ */
+__attribute__((target("avx2")))
+static inline void philox_sum_avx2(const RngStream *rng, __m256d acc[4]) {
+
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i m0 = _mm256_set1_epi32((int)PHILOX_M0);
+    const __m256i m1 = _mm256_set1_epi32((int)PHILOX_M1);
+    __m256i c0 = _mm256_add_epi32(_mm256_set1_epi32((int)(uint32_t)rng->block), lane);
+    __m256i c1 = _mm256_set1_epi32((int)(uint32_t)(rng->block >> 32));
+    __m256i c2 = _mm256_set1_epi32((int)(uint32_t)rng->stream);
+    __m256i c3 = _mm256_set1_epi32((int)(uint32_t)(rng->stream >> 32));
+    uint32_t k0 = rng->key[0], k1 = rng->key[1];
+
+    for (int round = 0; round < PHILOX_ROUNDS; round++) {
+        __m256i hi0, lo0, hi1, lo1;
+        mul_hi_lo_avx2(c0, m0, &hi0, &lo0);
+        mul_hi_lo_avx2(c2, m1, &hi1, &lo1);
+        c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32((int)k0));
+        c1 = lo1;
+        c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32((int)k1));
+        c3 = lo0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    acc[0] = _mm256_add_pd(acc[0], uniform_from_bits_avx2(_mm256_unpacklo_epi32(c0, c1)));
+    acc[1] = _mm256_add_pd(acc[1], uniform_from_bits_avx2(_mm256_unpackhi_epi32(c0, c1)));
+    acc[2] = _mm256_add_pd(acc[2], uniform_from_bits_avx2(_mm256_unpacklo_epi32(c2, c3)));
+    acc[3] = _mm256_add_pd(acc[3], uniform_from_bits_avx2(_mm256_unpackhi_epi32(c2, c3)));
+}
+
+/*
+ * Same draws as get_mean_of_uniform_random_samples, added in a different
+ * order. Both sums carry at most (samples - 1) * 2^-53 relative error per
+ * unit of |sample|, so the two means differ by at most SIMD_TOLERANCE.
+ */
+__attribute__((target("avx2")))
+double get_mean_of_uniform_random_samples_avx2(RngStream *rng) {
 
+    __m256d acc[4] = {_mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd(), _mm256_setzero_pd()};
+    double lanes[4];
     double sum = 0.0;
+    int i = 0;
+
+    /* The lane counters only add to the low word, so stop before it wraps. */
+    if (!rng->has_spare) {
+        for (; i + 2 * SIMD_BLOCKS <= config.samples && (uint32_t)rng->block <= UINT32_MAX - SIMD_BLOCKS; i += 2 * SIMD_BLOCKS) {
+            philox_sum_avx2(rng, acc);
+            rng->block += SIMD_BLOCKS;
+        }
+    }
+
+    _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(acc[0], acc[1]), _mm256_add_pd(acc[2], acc[3])));
+    sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+    for (; i < config.samples; i++) {
+        sum += uniform_from_bits(rng_next64(rng));
+    }
+
+    return sum / config.samples;
+}
+#endif
+
+typedef double (*mean_kernel)(RngStream *rng);
+
+static mean_kernel sample_mean = get_mean_of_uniform_random_samples;
+
+int simd_available(void) {
+
+#ifdef HAVE_AVX2_KERNEL
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Selects "scalar", "simd" or "auto" (simd when the CPU has it). Only the
+ * uniform distribution has a SIMD kernel; the others always run scalar.
+ */
+int select_kernel(const char *name) {
+
+    if (distribution.kind != DIST_UNIFORM) {
+        if (strcmp(name, "simd") == 0) {
+            fprintf(stderr, "Error: only the uniform distribution has a SIMD kernel.\n");
+            return -1;
+        }
+        sample_mean = get_mean_of_distribution_samples;
+        return 0;
+    }
+    if (strcmp(name, "scalar") == 0) {
+        sample_mean = get_mean_of_uniform_random_samples;
+        return 0;
+    }
+    if (strcmp(name, "simd") == 0 || strcmp(name, "auto") == 0) {
+        if (simd_available()) {
+#ifdef HAVE_AVX2_KERNEL
+            sample_mean = get_mean_of_uniform_random_samples_avx2;
+#endif
+            return 0;
+        }
+        if (strcmp(name, "auto") == 0) {
+            sample_mean = get_mean_of_uniform_random_samples;
+            return 0;
+        }
+        fprintf(stderr, "Error: this CPU has no SIMD kernel.\n");
+        return -1;
+    }
+    fprintf(stderr, "Error: unknown kernel %s.\n", name);
+    return -1;
+}
+
+/* The name that select_kernel maps to the current kernel. */
+const char *kernel_name(void) {
 
-    for (int i = 0; i < SAMPLES; i++) {
-        double r = ((double)rand() / (double)RAND_MAX) * 2.0 - 1.0;
-        sum += r;
+#ifdef HAVE_AVX2_KERNEL
+    if (sample_mean == get_mean_of_uniform_random_samples_avx2) {
+        return "simd";
     }
+#endif
+    return "scalar";
+}
+
+/*
+ * Runs are handed to worker threads RUN_BLOCK at a time. Every run draws
+ * from the stream numbered after it and writes only its own slot of
+ * values, so the contents of values do not depend on which thread ran
+ * what; the sums below then always add them in run order.
+ */
+typedef struct {
+    double *values;
+    uint64_t seed;
+    uint64_t next_run;
+    pthread_mutex_t lock;
+} RunQueue;
+
+static uint64_t claim_runs(RunQueue *queue, uint64_t *start) {
 
-    return sum / SAMPLES;
+    pthread_mutex_lock(&queue->lock);
+    *start = queue->next_run;
+    uint64_t count = config.runs - *start < RUN_BLOCK ? config.runs - *start : RUN_BLOCK;
+    queue->next_run += count;
+    pthread_mutex_unlock(&queue->lock);
+
+    return count;
+}
+
+static void *run_worker(void *arg) {
+
+    RunQueue *queue = (RunQueue *)arg;
+    RngStream rng;
+    uint64_t start, count;
+
+    while ((count = claim_runs(queue, &start)) > 0) {
+        for (uint64_t i = start; i < start + count; i++) {
+            rng_init(&rng, queue->seed, i);
+            queue->values[i] = sample_mean(&rng);
+        }
+    }
+
+    return NULL;
+}
+
+void populate_values(double *values, uint64_t seed, int num_threads) {
+
+    RunQueue queue = {values, seed, 0, PTHREAD_MUTEX_INITIALIZER};
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+
+    for (; started < num_threads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, run_worker, &queue) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+
+    run_worker(&queue);
+
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
 }
 
-double populate_values_and_get_mean(double *values) {
+double populate_values_and_get_mean(double *values, uint64_t seed, int num_threads) {
 
     double sum = 0.0;
 
-    for (int i = 0; i< RUNS; i++){
-        values[i] = get_mean_of_uniform_random_samples();
+    populate_values(values, seed, num_threads);
+
+    for (uint64_t i = 0; i< config.runs; i++){
         sum += values[i];
     }
 
-    return sum / RUNS;
+    return sum / config.runs;
 }
 
 double get_mean_squared_error(double values[], double mean) {
 
     double summation = 0.0;
 
-    for(int i = 0; i < RUNS; i++) {
+    for(uint64_t i = 0; i < config.runs; i++) {
     	double diff = mean - values[i];    
         summation += diff * diff;
     }
 
-    return summation / RUNS;
+    return summation / config.runs;
 }
 
-void create_histogram(double values[], int *counts) {
+/* The histogram covers config.span centered on the distribution mean. */
+int histogram_bin(double value) {
 
-    double bin_size = HISTOGRAM_SPAN / BINS;
+    double bin_size = config.span / config.bins;
+    double offset = (value - config.center + (config.span / 2.0)) / bin_size;
 
-    for (int i = 0; i < RUNS; i++) {
-        int idx = (int)((values[i] + (HISTOGRAM_SPAN / 2.0)) / bin_size);
-       
-        if (idx < 0) { 
-            idx = 0;
-        } else if (idx >= BINS ){ 
-            idx = BINS - 1;
-        }
+    if (offset < 0.0) { 
+        return 0;
+    } else if (offset >= config.bins ){ 
+        return config.bins - 1;
+    }
+
+    return (int)offset;
+}
+
+void create_histogram(double values[], uint64_t *counts) {
 
-        counts[idx] += 1;
+    for (uint64_t i = 0; i < config.runs; i++) {
+        counts[histogram_bin(values[i])] += 1;
     }
 }
 
-void print_histogram(int counts[]) {
+void print_histogram(uint64_t counts[]) {
 
-    double bin_start = -HISTOGRAM_SPAN / 2.0;
-    double bin_size = HISTOGRAM_SPAN / BINS;
+    double bin_start = config.center - config.span / 2.0;
+    double bin_size = config.span / config.bins;
+    uint64_t scale = config.scale;
 
-    for(int i = 0; i < BINS; i++){
+    /* A scale of 0 fits the tallest bar to MAX_BAR columns. */
+    if (scale == 0) {
+        uint64_t tallest = 0;
+        for (int i = 0; i < config.bins; i++) {
+            tallest = counts[i] > tallest ? counts[i] : tallest;
+        }
+        scale = tallest > MAX_BAR ? (tallest + MAX_BAR - 1) / MAX_BAR : 1;
+    }
+
+    for(int i = 0; i < config.bins; i++){
         double bin_center = bin_start + bin_size / 2.0;
         printf("%.4f ", bin_center);
 
-        for (int j = 0; j < counts[i] / SCALE; j++) {
+        for (uint64_t j = 0; j < counts[i] / scale; j++) {
             printf("X"); 
         }
 
@@ -82,22 +741,612 @@ void print_histogram(int counts[]) {
 }
 
 
+/*
+ * Streaming statistics.
+ * Each run's mean is folded into a running Welford mean and sum of squared
+ * deviations and binned on the spot, so nothing is kept per run. Workers
+ * summarize RUN_BLOCK runs at a time and merge the block summaries strictly
+ * in block order, which keeps the result independent of the thread count
+ * while holding at most one pending summary per thread.
+ */
+typedef struct {
+    uint64_t runs;
+    double mean;
+    double m2;
+    uint64_t counts[MAX_BINS];
+} RunningStats;
+
+void stats_add(RunningStats *stats, double value) {
+
+    stats->runs++;
+    double delta = value - stats->mean;
+    stats->mean += delta / stats->runs;
+    stats->m2 += delta * (value - stats->mean);
+    stats->counts[histogram_bin(value)] += 1;
+}
+
+/* Chan et al. pairwise combination of two summaries. */
+void stats_merge(RunningStats *into, const RunningStats *from) {
+
+    if (from->runs == 0) {
+        return;
+    }
+    if (into->runs == 0) {
+        *into = *from;
+        return;
+    }
+
+    double total = (double)(into->runs + from->runs);
+    double delta = from->mean - into->mean;
+
+    into->mean += delta * (double)from->runs / total;
+    into->m2 += from->m2 + delta * delta * (double)into->runs * (double)from->runs / total;
+    into->runs += from->runs;
+    for (int i = 0; i < config.bins; i++) {
+        into->counts[i] += from->counts[i];
+    }
+}
+
+double stats_variance(const RunningStats *stats) {
+
+    return stats->runs > 0 ? stats->m2 / stats->runs : 0.0;
+}
+
+/*
+ * Checkpoints.
+ * A checkpoint is the merged RunningStats plus what is needed to continue
+ * it: the settings that shape the result, the kernel, whose rounding does
+ * too, the seed, and the next RNG stream, which is the number of runs done
+ * because run i always draws from stream i. Fields are written one by one
+ * in host byte order after an 8-byte magic; the file is synced under a
+ * temporary name and renamed so a preempted write never leaves a torn file.
+ */
+#define CHECKPOINT_MAGIC "PA2CKPT3"
+#define KERNEL_NAME_LEN 8
+#define CHECKPOINT_EVERY 16384
+
+typedef struct {
+    uint64_t seed;
+    uint64_t target_runs;
+    int num_threads;
+    uint64_t progress_every;
+    const char *checkpoint_path;
+    uint64_t checkpoint_every;
+} StreamOptions;
+
+static int write_field(FILE *file, const void *field, size_t size) {
+
+    return fwrite(field, size, 1, file) == 1 ? 0 : -1;
+}
+
+static int read_field(FILE *file, void *field, size_t size) {
+
+    return fread(field, size, 1, file) == 1 ? 0 : -1;
+}
+
+int save_checkpoint(const char *path, uint64_t seed, const RunningStats *stats) {
+
+    size_t length = strlen(path) + sizeof(".tmp");
+    char *temp_path = malloc(length);
+
+    if (temp_path == NULL) {
+        return -1;
+    }
+    snprintf(temp_path, length, "%s.tmp", path);
+
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        perror(temp_path);
+        free(temp_path);
+        return -1;
+    }
+
+    uint32_t samples = (uint32_t)config.samples, bins = (uint32_t)config.bins;
+    char kernel[KERNEL_NAME_LEN] = {0};
+    strncpy(kernel, kernel_name(), KERNEL_NAME_LEN - 1);
+    int status = write_field(file, CHECKPOINT_MAGIC, 8) |
+                 write_field(file, &samples, sizeof(samples)) |
+                 write_field(file, &bins, sizeof(bins)) |
+                 write_field(file, &config.span, sizeof(config.span)) |
+                 write_field(file, &config.center, sizeof(config.center)) |
+                 write_field(file, config.distribution, sizeof(config.distribution)) |
+                 write_field(file, kernel, sizeof(kernel)) |
+                 write_field(file, &seed, sizeof(seed)) |
+                 write_field(file, &stats->runs, sizeof(stats->runs)) |
+                 write_field(file, &stats->mean, sizeof(stats->mean)) |
+                 write_field(file, &stats->m2, sizeof(stats->m2)) |
+                 write_field(file, stats->counts, bins * sizeof(stats->counts[0]));
+
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        status = -1;
+    }
+    if (fclose(file) != 0 || status != 0 || rename(temp_path, path) != 0) {
+        perror(path);
+        remove(temp_path);
+        status = -1;
+    }
+    free(temp_path);
+
+    return status;
+}
+
+/*
+ * Restores the settings saved with the checkpoint along with its state;
+ * kernel receives the name of the kernel it was written with.
+ */
+int load_checkpoint(const char *path, uint64_t *seed, RunningStats *stats, char *kernel) {
+
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char magic[8];
+    char spec[DIST_SPEC_LEN];
+    uint32_t samples, bins;
+    double span, center;
+    int status = read_field(file, magic, sizeof(magic)) |
+                 read_field(file, &samples, sizeof(samples)) |
+                 read_field(file, &bins, sizeof(bins)) |
+                 read_field(file, &span, sizeof(span)) |
+                 read_field(file, &center, sizeof(center)) |
+                 read_field(file, spec, sizeof(spec)) |
+                 read_field(file, kernel, KERNEL_NAME_LEN);
+
+    if (status != 0 || memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "Error: %s is not a checkpoint file.\n", path);
+        fclose(file);
+        return -1;
+    }
+    spec[DIST_SPEC_LEN - 1] = '\0';
+    kernel[KERNEL_NAME_LEN - 1] = '\0';
+    if (samples == 0 || bins == 0 || bins > MAX_BINS || select_distribution(spec) != 0) {
+        fprintf(stderr, "Error: %s has invalid settings.\n", path);
+        fclose(file);
+        return -1;
+    }
+    config.samples = (int)samples;
+    config.bins = (int)bins;
+    config.span = span;
+    config.center = center;
+
+    memset(stats, 0, sizeof(*stats));
+    status = read_field(file, seed, sizeof(*seed)) |
+             read_field(file, &stats->runs, sizeof(stats->runs)) |
+             read_field(file, &stats->mean, sizeof(stats->mean)) |
+             read_field(file, &stats->m2, sizeof(stats->m2)) |
+             read_field(file, stats->counts, bins * sizeof(stats->counts[0]));
+    fclose(file);
+
+    if (status != 0) {
+        fprintf(stderr, "Error: %s is truncated.\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+typedef struct {
+    const StreamOptions *options;
+    uint64_t first_run;
+    uint64_t next_block;
+    uint64_t merged_blocks;
+    RunningStats total;
+    pthread_mutex_t lock;
+    pthread_cond_t merged;
+} StreamState;
+
+/* True when count went past a multiple of every by going from before to after. */
+static int crossed(uint64_t before, uint64_t after, uint64_t every) {
+
+    return every > 0 && before / every != after / every;
+}
+
+static void *stream_worker(void *arg) {
+
+    StreamState *state = (StreamState *)arg;
+    const StreamOptions *options = state->options;
+    RunningStats local;
+    RngStream rng;
+
+    for (;;) {
+        pthread_mutex_lock(&state->lock);
+        uint64_t block = state->next_block;
+        uint64_t start = state->first_run + block * RUN_BLOCK;
+        if (start >= options->target_runs) {
+            pthread_mutex_unlock(&state->lock);
+            break;
+        }
+        state->next_block++;
+        pthread_mutex_unlock(&state->lock);
+
+        uint64_t end = start + RUN_BLOCK < options->target_runs ? start + RUN_BLOCK : options->target_runs;
+        memset(&local, 0, sizeof(local));
+        for (uint64_t run = start; run < end; run++) {
+            rng_init(&rng, options->seed, run);
+            stats_add(&local, sample_mean(&rng));
+        }
+
+        pthread_mutex_lock(&state->lock);
+        while (state->merged_blocks != block) {
+            pthread_cond_wait(&state->merged, &state->lock);
+        }
+        uint64_t before = state->total.runs;
+        stats_merge(&state->total, &local);
+        state->merged_blocks++;
+        if (crossed(before, state->total.runs, options->progress_every)) {
+            fprintf(stderr, "After %llu runs: mean %.6f   variance %.6f\n",
+                    (unsigned long long)state->total.runs, state->total.mean, stats_variance(&state->total));
+        }
+        if (options->checkpoint_path != NULL && crossed(before, state->total.runs, options->checkpoint_every)) {
+            save_checkpoint(options->checkpoint_path, options->seed, &state->total);
+        }
+        pthread_cond_broadcast(&state->merged);
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Continues stats, which may hold runs loaded from a checkpoint, up to
+ * options->target_runs runs in constant memory.
+ */
+int run_streaming(RunningStats *stats, const StreamOptions *options) {
+
+    StreamState state;
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+
+    memset(&state, 0, sizeof(state));
+    state.options = options;
+    state.first_run = stats->runs;
+    state.total = *stats;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.merged, NULL);
+
+    for (; started < options->num_threads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, stream_worker, &state) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+
+    stream_worker(&state);
+
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    pthread_cond_destroy(&state.merged);
+    pthread_mutex_destroy(&state.lock);
+    *stats = state.total;
+
+    if (options->checkpoint_path != NULL) {
+        return save_checkpoint(options->checkpoint_path, options->seed, stats);
+    }
+
+    return 0;
+}
+
+double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Repeats the whole simulation with 1, 2, 4, ... threads up to max_threads
+ * and checks that mean, variance and histogram match the one-thread run
+ * bit for bit.
+ */
+int run_scaling_benchmark(double *values, uint64_t *counts, uint64_t seed, int max_threads) {
+
+    double base_time = 0.0, base_avg = 0.0, base_mse = 0.0;
+    uint64_t base_counts[MAX_BINS];
+    int all_identical = 1;
+
+    printf("threads  seconds     speedup  identical\n");
+
+    for (int threads = 1; ; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+        struct timespec start, end;
+
+        memset(counts, 0, config.bins * sizeof(uint64_t));
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        double avg = populate_values_and_get_mean(values, seed, threads);
+        double mse = get_mean_squared_error(values, avg);
+        create_histogram(values, counts);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = elapsed_seconds(&start, &end);
+        int identical = 1;
+
+        if (threads == 1) {
+            base_time = seconds;
+            base_avg = avg;
+            base_mse = mse;
+            memcpy(base_counts, counts, config.bins * sizeof(uint64_t));
+        } else {
+            identical = memcmp(&avg, &base_avg, sizeof(avg)) == 0 &&
+                        memcmp(&mse, &base_mse, sizeof(mse)) == 0 &&
+                        memcmp(counts, base_counts, config.bins * sizeof(uint64_t)) == 0;
+        }
+        all_identical = all_identical && identical;
+
+        printf("%7d  %10.4f  %7.3f  %s\n", threads, seconds, base_time / seconds, identical ? "yes" : "NO");
+
+        if (threads >= max_threads) {
+            break;
+        }
+    }
+
+    return all_identical ? 0 : 1;
+}
+
+static double time_populate(double *values, uint64_t seed) {
+
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    populate_values(values, seed, 1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return elapsed_seconds(&start, &end);
+}
+
+/*
+ * Times each available uniform kernel on one thread over the same runs and
+ * reports samples per second and the largest difference from the scalar
+ * means, then the throughput of each non-uniform distribution.
+ */
+int run_kernel_benchmark(double *values, uint64_t seed) {
+
+    static const char * const kernels[] = {"scalar", "simd"};
+    static const char * const others[] = {"normal", "exponential", "discrete:1,1,1,1,1,1"};
+    double *reference = malloc(config.runs * sizeof(double));
+    int within_tolerance = 1;
+
+    if (reference == NULL) {
+        fprintf(stderr, "Error: Unable to allocate memory for reference array.\n");
+        return 1;
+    }
+
+    printf("kernel                samples/s    max |diff|\n");
+
+    select_distribution("uniform");
+    for (int k = 0; k < 2; k++) {
+        if (k > 0 && !simd_available()) {
+            printf("uniform/%-12s  unavailable on this CPU\n", kernels[k]);
+            continue;
+        }
+        select_kernel(kernels[k]);
+
+        double seconds = time_populate(values, seed);
+        double max_diff = 0.0;
+
+        if (k == 0) {
+            memcpy(reference, values, config.runs * sizeof(double));
+        }
+        for (uint64_t i = 0; i < config.runs; i++) {
+            double diff = fabs(values[i] - reference[i]);
+            max_diff = diff > max_diff ? diff : max_diff;
+        }
+        within_tolerance = within_tolerance && max_diff <= SIMD_TOLERANCE;
+
+        printf("uniform/%-12s  %12.4e  %.3e\n", kernels[k], (double)config.runs * config.samples / seconds, max_diff);
+    }
+    printf("tolerance %.3e: %s\n", SIMD_TOLERANCE, within_tolerance ? "ok" : "EXCEEDED");
+
+    for (int d = 0; d < 3; d++) {
+        select_distribution(others[d]);
+        select_kernel("auto");
+
+        double seconds = time_populate(values, seed);
+        printf("%-20.20s  %12.4e\n", others[d], (double)config.runs * config.samples / seconds);
+    }
+
+    free(reference);
+
+    return within_tolerance ? 0 : 1;
+}
+
+/*
+ * Estimates the spread of run means from the first PILOT_RUNS runs, for
+ * modes that must bin before the full variance is known.
+ */
+double pilot_span(uint64_t seed) {
+
+    RunningStats pilot;
+    RngStream rng;
+    uint64_t runs = config.runs < PILOT_RUNS ? config.runs : PILOT_RUNS;
+
+    memset(&pilot, 0, sizeof(pilot));
+    for (uint64_t run = 0; run < runs; run++) {
+        rng_init(&rng, seed, run);
+        stats_add(&pilot, sample_mean(&rng));
+    }
+
+    return SPAN_SIGMAS * sqrt(stats_variance(&pilot));
+}
+
+/* Falls back to the default span when the observed spread is zero. */
+void set_span(double span) {
+
+    config.span = span > 0.0 ? span : HISTOGRAM_SPAN;
+}
+
+void print_usage(const char *program) {
+
+    fprintf(stderr, "Usage: %s [-s seed] [-j threads] [-k scalar|simd|auto] [-S [-P every]]\n"
+            "          [-c checkpoint [-C every]] [-r checkpoint [-e more_runs]] [-b | -K]\n"
+            "          [-n samples] [-N runs] [-H bins] [-w span|auto] [-x scale|auto]\n"
+            "          [-d uniform|normal|exponential|discrete:w0,w1,...] [test]\n", program);
+}
+
 int main(int argc, char *argv[]) {
 
-    if (argc >= 2 && strcmp(argv[1], "test") == 0) {
-        srand(1);
-    } else {
-        srand((unsigned)time(NULL));
+    uint64_t seed = (uint64_t)time(NULL);
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = online < 1 ? 1 : online > MAX_THREADS ? MAX_THREADS : (int)online;
+    const char *kernel = NULL;
+    const char *dist_spec = "uniform";
+    int benchmark = 0;
+    int kernel_benchmark = 0;
+    int streaming = 0;
+    uint64_t progress_every = 0;
+    const char *checkpoint_path = NULL;
+    uint64_t checkpoint_every = CHECKPOINT_EVERY;
+    const char *resume_path = NULL;
+    uint64_t more_runs = 0;
+    long long samples = config.samples, runs = (long long)config.runs, bins = config.bins;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:j:k:bKSP:c:C:r:e:n:N:H:w:x:d:")) != -1) {
+        switch (opt) {
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'j':
+            num_threads = atoi(optarg);
+            break;
+        case 'k':
+            kernel = optarg;
+            break;
+        case 'b':
+            benchmark = 1;
+            break;
+        case 'K':
+            kernel_benchmark = 1;
+            break;
+        case 'S':
+            streaming = 1;
+            break;
+        case 'P':
+            progress_every = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            checkpoint_path = optarg;
+            break;
+        case 'C':
+            checkpoint_every = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            resume_path = optarg;
+            break;
+        case 'e':
+            more_runs = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            samples = strtoll(optarg, NULL, 0);
+            break;
+        case 'N':
+            runs = strtoll(optarg, NULL, 0);
+            break;
+        case 'H':
+            bins = strtoll(optarg, NULL, 0);
+            break;
+        case 'w':
+            config.span = strcmp(optarg, "auto") == 0 ? 0.0 : strtod(optarg, NULL);
+            break;
+        case 'x':
+            config.scale = strcmp(optarg, "auto") == 0 ? 0 : strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            dist_spec = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_threads < 1 || num_threads > MAX_THREADS) {
+        fprintf(stderr, "Error: thread count must be between 1 and %d.\n", MAX_THREADS);
+        return 1;
+    }
+    if (samples < 1 || samples > INT32_MAX || runs < 1 || bins < 1 || bins > MAX_BINS || config.span < 0.0) {
+        fprintf(stderr, "Error: samples and runs must be positive, bins between 1 and %d, span positive or auto.\n", MAX_BINS);
+        return 1;
+    }
+    config.samples = (int)samples;
+    config.runs = (uint64_t)runs;
+    config.bins = (int)bins;
+
+    build_ziggurat_tables();
+    if (select_distribution(dist_spec) != 0) {
+        return 1;
+    }
+
+    /* The expected test output is defined by the scalar kernel. */
+    if (optind < argc && strcmp(argv[optind], "test") == 0) {
+        seed = TEST_SEED;
+        if (kernel == NULL) {
+            kernel = "scalar";
+        }
+    }
+
+    /* Checkpointing needs the streaming engine; resuming also keeps writing to the same file. */
+    if (checkpoint_path != NULL || resume_path != NULL) {
+        streaming = 1;
+    }
+    if (checkpoint_path == NULL) {
+        checkpoint_path = resume_path;
     }
 
-    double *values = malloc(RUNS * sizeof(double));
+    if (streaming) {
+        RunningStats stats;
+        char saved_kernel[KERNEL_NAME_LEN] = "";
+        StreamOptions options = {seed, config.runs, num_threads, progress_every, checkpoint_path, checkpoint_every};
+
+        memset(&stats, 0, sizeof(stats));
+        if (resume_path != NULL) {
+            if (load_checkpoint(resume_path, &options.seed, &stats, saved_kernel) != 0) {
+                return 1;
+            }
+            if (kernel == NULL) {
+                kernel = saved_kernel;
+            }
+            /* Resume up to the run count, or extend a result that is already there. */
+            options.target_runs = more_runs > 0 ? stats.runs + more_runs
+                                                : (stats.runs > config.runs ? stats.runs : config.runs);
+        }
+        if (select_kernel(kernel != NULL ? kernel : "auto") != 0) {
+            return 1;
+        }
+        /* The kernels round differently, so a resumed run must keep its kernel. */
+        if (resume_path != NULL && strcmp(kernel_name(), saved_kernel) != 0) {
+            fprintf(stderr, "Error: %s was written with the %s kernel, not %s.\n",
+                    resume_path, saved_kernel, kernel_name());
+            return 1;
+        }
+        if (config.span == 0.0) {
+            set_span(pilot_span(options.seed));
+        }
+
+        if (run_streaming(&stats, &options) != 0) {
+            return 1;
+        }
+        print_histogram(stats.counts);
+
+        printf("Sample mean over %llu means of %d samples each: %.6f   Sample variance: %.6f\n",
+               (unsigned long long)stats.runs, config.samples, stats.mean, stats_variance(&stats));
+
+        return 0;
+    }
+
+    if (select_kernel(kernel != NULL ? kernel : "auto") != 0) {
+        return 1;
+    }
+
+    double *values = malloc(config.runs * sizeof(double));
 
     if (values == NULL) {
         fprintf(stderr, "Error: Unable to allocate memory for values array.\n");
         return 1;
     }
 
-    int *counts = calloc(BINS, sizeof(int));
+    uint64_t *counts = calloc(config.bins, sizeof(uint64_t));
 
     if (counts == NULL) {
         fprintf(stderr, "Error: Unable to allocate memory for counts array.\n");
@@ -106,13 +1355,31 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    double avg = populate_values_and_get_mean(values);
+    if (benchmark || kernel_benchmark) {
+        if (config.span == 0.0) {
+            set_span(pilot_span(seed));
+        }
+
+        int status = kernel_benchmark ? run_kernel_benchmark(values, seed)
+                                      : run_scaling_benchmark(values, counts, seed, num_threads);
+
+        free(values);
+        free(counts);
+
+        return status;
+    }
+
+    double avg = populate_values_and_get_mean(values, seed, num_threads);
     double mse = get_mean_squared_error(values, avg);
     
+    if (config.span == 0.0) {
+        set_span(SPAN_SIGMAS * sqrt(mse));
+    }
     create_histogram(values, counts);
     print_histogram(counts);
 
-    printf("Sample mean over %d means of %d samples each: %.6f   Sample variance: %.6f\n", RUNS, SAMPLES, avg, mse);
+    printf("Sample mean over %llu means of %d samples each: %.6f   Sample variance: %.6f\n",
+           (unsigned long long)config.runs, config.samples, avg, mse);
 
     free(values);
     free(counts);
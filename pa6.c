@@ -7,15 +7,68 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
+
+#include "pa8/matrix_kernels.h"
 
 #define MAX_VALUE 20
 #define TRUE  1
 #define FALSE 0
-#define MICROSECOND_PER_SECOND 1000000
+#define MICROSECONDS_PER_SECOND 1000000
 #define MIN_DIM_POWER 3
 #define MAX_DIM_POWER 10
+#define TILE 32
+#define TRANSPOSE_LEAF 16
+#define PANEL_WIDTH 64
+#define PANEL_DEPTH 256
+#define PROFILE_MIN_SECONDS 0.05
+#define PROBE_MIN_BYTES (4 << 10)
+#define PROBE_MAX_BYTES (64 << 20)
+#define PROBE_ACCESSES (1 << 22)
+#define LATENCY_JUMP 1.5
+#define DEFAULT_LINE_BYTES 64
+
+/* Time spent in each phase of a multiplication, accumulated across calls. */
+typedef struct {
+    struct timeval transpose;
+    struct timeval multiply;
+} PhaseTimes;
+
+typedef void (*mult_func)(const int dim,
+                          const int * const a,
+                          const int * const b,
+                          int * const c,
+                          int * const scratch,
+                          PhaseTimes * const phases);
+
+DEFINE_MATRIX_KERNELS(static inline, int, int, int)
+
+static int min(const int x, const int y) {
+    return x < y ? x : y;
+}
+
+struct timeval time_diff(const struct timeval * const start, const struct timeval * const end) {
+    struct timeval elapsed;
+    elapsed.tv_sec = end->tv_sec - start->tv_sec;
+    elapsed.tv_usec = end->tv_usec - start->tv_usec;
+    if (elapsed.tv_usec < 0) {
+        elapsed.tv_sec -= 1;
+        elapsed.tv_usec += MICROSECONDS_PER_SECOND;
+    }
+    return elapsed;
+}
 
+void add_elapsed(struct timeval * const total, const struct timeval * const start, const struct timeval * const end) {
+    struct timeval elapsed = time_diff(start, end);
+    total->tv_sec += elapsed.tv_sec;
+    total->tv_usec += elapsed.tv_usec;
+    if (total->tv_usec >= MICROSECONDS_PER_SECOND) {
+        total->tv_sec += 1;
+        total->tv_usec -= MICROSECONDS_PER_SECOND;
+    }
+}
 
 void init(const int dim, int * const m) {
     for (int i = 0; i < dim * dim; i++) {
@@ -54,6 +107,113 @@ void transpose(const int dim, int * const m) {
     }
 }
 
+/*
+ * In-place transpose that swaps TILE-by-TILE blocks below the diagonal with
+ * their mirror images above it, so both sides of each swap stay in cache.
+ */
+void transpose_blocked(const int dim, int * const m) {
+    for (int ii = 0; ii < dim; ii += TILE) {
+        const int i_end = min(ii + TILE, dim);
+        for (int jj = 0; jj <= ii; jj += TILE) {
+            for (int i = ii; i < i_end; ++i) {
+                const int j_end = (jj == ii) ? i : min(jj + TILE, dim);
+                for (int j = jj; j < j_end; ++j) {
+                    int tmp = m[i * dim + j];
+                    m[i * dim + j] = m[j * dim + i];
+                    m[j * dim + i] = tmp;
+                }
+            }
+        }
+    }
+}
+
+/* Swaps the rows-by-cols block at (r0, c0) with its mirror at (c0, r0). */
+static void swap_mirror_blocks(const int dim, int * const m,
+                               const int r0, const int c0,
+                               const int rows, const int cols) {
+    if (rows <= TRANSPOSE_LEAF && cols <= TRANSPOSE_LEAF) {
+        for (int i = r0; i < r0 + rows; ++i) {
+            for (int j = c0; j < c0 + cols; ++j) {
+                int tmp = m[i * dim + j];
+                m[i * dim + j] = m[j * dim + i];
+                m[j * dim + i] = tmp;
+            }
+        }
+    } else if (rows >= cols) {
+        const int half = rows / 2;
+        swap_mirror_blocks(dim, m, r0, c0, half, cols);
+        swap_mirror_blocks(dim, m, r0 + half, c0, rows - half, cols);
+    } else {
+        const int half = cols / 2;
+        swap_mirror_blocks(dim, m, r0, c0, rows, half);
+        swap_mirror_blocks(dim, m, r0, c0 + half, rows, cols - half);
+    }
+}
+
+static void transpose_diagonal_block(const int dim, int * const m, const int lo, const int n) {
+    if (n <= TRANSPOSE_LEAF) {
+        for (int i = lo; i < lo + n; ++i) {
+            for (int j = lo; j < i; ++j) {
+                int tmp = m[i * dim + j];
+                m[i * dim + j] = m[j * dim + i];
+                m[j * dim + i] = tmp;
+            }
+        }
+        return;
+    }
+    const int half = n / 2;
+    transpose_diagonal_block(dim, m, lo, half);
+    transpose_diagonal_block(dim, m, lo + half, n - half);
+    swap_mirror_blocks(dim, m, lo + half, lo, n - half, half);
+}
+
+/*
+ * Cache-oblivious in-place transpose: recursively halves the matrix until the
+ * pieces fit in whatever level of cache the host has, without a tuned TILE.
+ */
+void transpose_recursive(const int dim, int * const m) {
+    transpose_diagonal_block(dim, m, 0, dim);
+}
+
+/*
+ * Cache-oblivious out-of-place transpose of a rows-by-cols block:
+ * dst[j * dst_stride + i] = src[i * src_stride + j]. The source is untouched.
+ */
+void transpose_rect(const int rows, const int cols,
+                    const int * const src, const int src_stride,
+                    int * const dst, const int dst_stride) {
+    if (rows <= TRANSPOSE_LEAF && cols <= TRANSPOSE_LEAF) {
+        for (int i = 0; i < rows; ++i) {
+            for (int j = 0; j < cols; ++j) {
+                dst[j * dst_stride + i] = src[i * src_stride + j];
+            }
+        }
+    } else if (rows >= cols) {
+        const int half = rows / 2;
+        transpose_rect(half, cols, src, src_stride, dst, dst_stride);
+        transpose_rect(rows - half, cols, src + half * src_stride, src_stride,
+                       dst + half, dst_stride);
+    } else {
+        const int half = cols / 2;
+        transpose_rect(rows, half, src, src_stride, dst, dst_stride);
+        transpose_rect(rows, cols - half, src + half, src_stride,
+                       dst + half * dst_stride, dst_stride);
+    }
+}
+
+void transpose_copy(const int dim, const int * const m, int * const m_t) {
+    transpose_rect(dim, dim, m, dim, m_t, dim);
+}
+
+/*
+ * Packs the depth-by-width block of b at (k0, j0) into panel so that each
+ * column becomes a contiguous row of length depth: the block transposed.
+ */
+void pack_b_panel(const int dim, const int * const b, const int k0, const int j0,
+                  const int depth, const int width, int * const panel) {
+    transpose_rect(depth, width, b + k0 * dim + j0, dim, panel, depth);
+}
+
 void multiply_transpose(const int dim, const int * const a, const int * const b_t, int * const c) {
     for (int i = 0; i < dim; ++i) {
         for (int j = 0; j < dim; ++j) {
@@ -67,16 +227,104 @@ void multiply_transpose(const int dim, const int * const a, const int * const b_
 }
 
 int verify(const int dim, const int * const c1, const int * const c2) {
-    for (int i = 0; i < dim * dim; i++) {
-        if (c1[i] != c2[i])
-            return FALSE;
+    return matrix_verify_int(c1, c2, dim) == 0 ? TRUE : FALSE;
+}
+
+void standard_multiply(const int dim, const int * const a, const int * const b, int * const c,
+                       int * const scratch, PhaseTimes * const phases) {
+    (void)scratch;
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    multiply(dim, a, b, c);
+    gettimeofday(&end, NULL);
+    add_elapsed(&phases->multiply, &start, &end);
+}
+
+/* scratch must hold dim * dim ints; b is left unmodified. */
+void transpose_and_multiply(const int dim, const int * const a, const int * const b, int * const c,
+                            int * const scratch, PhaseTimes * const phases) {
+    struct timeval start, mid, end;
+    gettimeofday(&start, NULL);
+    transpose_copy(dim, b, scratch);
+    gettimeofday(&mid, NULL);
+    multiply_transpose(dim, a, scratch, c);
+    gettimeofday(&end, NULL);
+    add_elapsed(&phases->transpose, &start, &mid);
+    add_elapsed(&phases->multiply, &mid, &end);
+}
+
+/*
+ * Walks b one PANEL_DEPTH-by-PANEL_WIDTH block at a time, packing each block
+ * with the same transpose used above so the working set is a single panel
+ * instead of the whole transposed matrix. scratch must hold that many ints.
+ */
+void panel_multiply(const int dim, const int * const a, const int * const b, int * const c,
+                    int * const scratch, PhaseTimes * const phases) {
+    for (int j0 = 0; j0 < dim; j0 += PANEL_WIDTH) {
+        const int width = min(PANEL_WIDTH, dim - j0);
+        for (int k0 = 0; k0 < dim; k0 += PANEL_DEPTH) {
+            const int depth = min(PANEL_DEPTH, dim - k0);
+            struct timeval start, mid, end;
+            gettimeofday(&start, NULL);
+            pack_b_panel(dim, b, k0, j0, depth, width, scratch);
+            gettimeofday(&mid, NULL);
+            for (int i = 0; i < dim; ++i) {
+                const int * const a_row = a + i * dim + k0;
+                int * const c_row = c + i * dim + j0;
+                for (int jj = 0; jj < width; ++jj) {
+                    const int * const b_col = scratch + jj * depth;
+                    int product_summation = (k0 == 0) ? 0 : c_row[jj];
+                    for (int k = 0; k < depth; ++k) {
+                        product_summation += a_row[k] * b_col[k];
+                    }
+                    c_row[jj] = product_summation;
+                }
+            }
+            gettimeofday(&end, NULL);
+            add_elapsed(&phases->transpose, &start, &mid);
+            add_elapsed(&phases->multiply, &mid, &end);
+        }
     }
-    return TRUE;
 }
 
-void transpose_and_multiply(const int dim, const int * const a, int * const b, int * const c) {
-    transpose(dim, b);
-    multiply_transpose(dim, a, b, c);
+struct timeval run_and_time(
+    mult_func func,
+    const int dim,
+    const int * const a,
+    const int * const b,
+    int * const c,
+    int * const scratch,
+    PhaseTimes * const phases
+) {
+    struct timeval start, end;
+    memset(phases, 0, sizeof(*phases));
+    gettimeofday(&start, NULL);
+    func(dim, a, b, c, scratch, phases);
+    gettimeofday(&end, NULL);
+    return time_diff(&start, &end);
+}
+
+struct timeval time_transpose(void (*transpose_func)(const int, int * const), const int dim, int * const m) {
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    transpose_func(dim, m);
+    gettimeofday(&end, NULL);
+    return time_diff(&start, &end);
+}
+
+double get_speedup(struct timeval * result1, struct timeval * result2) {
+    double t1 = result1->tv_sec + result1->tv_usec / 1000000.0;
+    double t2 = result2->tv_sec + result2->tv_usec / 1000000.0;
+    return t1 / t2;
+}
+
+void print_time(const char * const label, const struct timeval * const tv) {
+    printf("%s: %ld seconds, %d microseconds\n", label, (long)tv->tv_sec, (int)tv->tv_usec);
+}
+
+void print_phases(const PhaseTimes * const phases) {
+    print_time("    transpose/pack phase", &phases->transpose);
+    print_time("    multiply phase", &phases->multiply);
 }
 
 void run_test(const int dim) {
@@ -84,8 +332,10 @@ void run_test(const int dim) {
     int *b  = (int *) calloc(dim * dim, sizeof(int));
     int *c1 = (int *) calloc(dim * dim, sizeof(int));
     int *c2 = (int *) calloc(dim * dim, sizeof(int));
+    int *c3 = (int *) calloc(dim * dim, sizeof(int));
+    int *scratch = (int *) calloc(dim * dim, sizeof(int));
 
-    if (!a || !b || !c1 || !c2) {
+    if (!a || !b || !c1 || !c2 || !c3 || !scratch) {
         fprintf(stderr, "Memory allocation failed!\n");
         exit(EXIT_FAILURE);
     }
@@ -93,59 +343,342 @@ void run_test(const int dim) {
     init(dim, a);
     init(dim, b);
 
-    struct timeval tv1 = run_and_time(multiply, dim, a, b, c1);
-    struct timeval tv2 = run_and_time(transpose_and_multiply, dim, a, b, c2);
+    PhaseTimes p1, p2, p3;
+    struct timeval tv1 = run_and_time(standard_multiply, dim, a, b, c1, scratch, &p1);
+    struct timeval tv2 = run_and_time(transpose_and_multiply, dim, a, b, c2, scratch, &p2);
+    struct timeval tv3 = run_and_time(panel_multiply, dim, a, b, c3, scratch, &p3);
 
-    int ok = verify(dim, c1, c2);
+    int ok = verify(dim, c1, c2) && verify(dim, c1, c3);
     printf("Testing on %d-by-%d square matrices.\n", dim, dim);
     if (ok == TRUE) {
         printf("Results agree.\n");
     } else {
         printf("Results do not agree.\n");
     }
-    printf("Standard multiplication: %ld seconds, %d microseconds\n",
-           (long)tv1.tv_sec, (int)tv1.tv_usec);
-    printf("Multiplication with transpose: %ld seconds, %d microseconds\n",
-           (long)tv2.tv_sec, (int)tv2.tv_usec);
+    print_time("Standard multiplication", &tv1);
+    print_time("Multiplication with transpose", &tv2);
+    print_phases(&p2);
+    print_time("Multiplication with packed B panels", &tv3);
+    print_phases(&p3);
+
+    /* Each in-place transpose runs on a copy of b and is checked against the
+     * out-of-place transpose. */
+    struct timeval copy_start, copy_end;
+    gettimeofday(&copy_start, NULL);
+    transpose_copy(dim, b, scratch);
+    gettimeofday(&copy_end, NULL);
+    struct timeval out_of_place = time_diff(&copy_start, &copy_end);
+    memcpy(c1, b, dim * dim * sizeof(int));
+    struct timeval naive = time_transpose(transpose, dim, c1);
+    memcpy(c2, b, dim * dim * sizeof(int));
+    struct timeval blocked = time_transpose(transpose_blocked, dim, c2);
+    memcpy(c3, b, dim * dim * sizeof(int));
+    struct timeval recursive = time_transpose(transpose_recursive, dim, c3);
+    ok = verify(dim, c1, scratch) && verify(dim, c2, scratch) && verify(dim, c3, scratch);
+    printf("Transposes %s.\n", ok == TRUE ? "agree" : "do not agree");
+    print_time("    naive transpose", &naive);
+    print_time("    blocked transpose", &blocked);
+    print_time("    recursive transpose", &recursive);
+    print_time("    out-of-place transpose", &out_of_place);
 
     double speedup = get_speedup(&tv1, &tv2);
-    printf("Speedup: %f\n\n", speedup);
+    printf("Speedup: %f\n", speedup);
+    printf("Speedup with packed B panels: %f\n\n", get_speedup(&tv1, &tv3));
 
     free(a);
     free(b);
     free(c1);
     free(c2);
+    free(c3);
+    free(scratch);
 }
 
-struct timeval run_and_time(
-    void (* mult_func)(const int, const int * const, int * const, int * const),
-    const int dim,
-    const int * const a,
-    int * const b,
-    int * const c
-) {
-    struct timeval start, end, elapsed;
-    gettimeofday(&start, NULL);
-    mult_func(dim, a, b, c);
-    gettimeofday(&end, NULL);
+/*
+ * Memory-hierarchy profiler.
+ * Times every loop order and the tiled kernel over the size sweep, then
+ * probes load latency (pointer chasing) and strided bandwidth over a range
+ * of working sets, so the cache levels of the host can be read off the
+ * output. Results go to stdout as an aligned table or as CSV.
+ */
+#define LOOP_ORDER_KERNEL(order, x, y, z)                                      \
+void multiply_##order(const int dim, const int * const a, const int * const b, \
+                      int * const c) {                                         \
+    memset(c, 0, dim * dim * sizeof(int));                                     \
+    for (int x = 0; x < dim; ++x) {                                            \
+        for (int y = 0; y < dim; ++y) {                                        \
+            for (int z = 0; z < dim; ++z) {                                    \
+                c[i * dim + j] += a[i * dim + k] * b[k * dim + j];             \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+}
 
-    elapsed.tv_sec = end.tv_sec - start.tv_sec;
-    elapsed.tv_usec = end.tv_usec - start.tv_usec;
-    if (elapsed.tv_usec < 0) {
-        elapsed.tv_sec -= 1;
-        elapsed.tv_usec += MICROSECONDS_PER_SECOND;
+LOOP_ORDER_KERNEL(ijk, i, j, k)
+LOOP_ORDER_KERNEL(ikj, i, k, j)
+LOOP_ORDER_KERNEL(jik, j, i, k)
+LOOP_ORDER_KERNEL(jki, j, k, i)
+LOOP_ORDER_KERNEL(kij, k, i, j)
+LOOP_ORDER_KERNEL(kji, k, j, i)
+
+typedef struct {
+    const char *name;
+    void (*func)(const int, const int * const, const int * const, int * const);
+} LoopOrder;
+
+static const LoopOrder loop_orders[] = {
+    {"ijk", multiply_ijk}, {"ikj", multiply_ikj}, {"jik", multiply_jik},
+    {"jki", multiply_jki}, {"kij", multiply_kij}, {"kji", multiply_kji},
+};
+static const int tile_sizes[] = {16, 32, 64, 128};
+
+#define NUM_LOOP_ORDERS ((int)(sizeof(loop_orders) / sizeof(loop_orders[0])))
+#define NUM_TILE_SIZES  ((int)(sizeof(tile_sizes) / sizeof(tile_sizes[0])))
+
+static int csv_output = FALSE;
+static volatile size_t probe_sink;
+
+double now_seconds(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / (double)MICROSECONDS_PER_SECOND;
+}
+
+void print_profile_header(void) {
+    if (csv_output) {
+        printf("section,variant,param,size,seconds,rate,unit\n");
+    } else {
+        printf("%-10s %-8s %8s %12s %14s %14s %s\n",
+               "section", "variant", "param", "size", "seconds", "rate", "unit");
     }
+}
 
-    return elapsed;
+void print_profile_row(const char * const section, const char * const variant, const int param,
+                       const long size, const double seconds, const double rate, const char * const unit) {
+    if (csv_output) {
+        printf("%s,%s,%d,%ld,%.9f,%.4f,%s\n", section, variant, param, size, seconds, rate, unit);
+    } else {
+        printf("%-10s %-8s %8d %12ld %14.9f %14.4f %s\n", section, variant, param, size, seconds, rate, unit);
+    }
 }
 
-double get_speedup(struct timeval * result1, struct timeval * result2) {
-    double t1 = result1->tv_sec + result1->tv_usec / 1000000.0;
-    double t2 = result2->tv_sec + result2->tv_usec / 1000000.0;
-    return t1 / t2;
+/*
+ * Repeats a kernel until PROFILE_MIN_SECONDS have passed; returns seconds per
+ * call. A tile of 0 runs the loop order, any other the shared tiled kernel.
+ */
+double time_kernel(const LoopOrder * const order, const int tile, const int dim,
+                   const int * const a, const int * const b, int * const c) {
+    int reps = 0;
+    double start = now_seconds(), elapsed;
+    do {
+        if (tile > 0) {
+            matrix_multiply_rect_int(a, b, c, dim, dim, 0, dim, tile);
+        } else {
+            order->func(dim, a, b, c);
+        }
+        ++reps;
+        elapsed = now_seconds() - start;
+    } while (elapsed < PROFILE_MIN_SECONDS);
+    return elapsed / reps;
+}
+
+void profile_kernels(const int max_power) {
+    for (int power = MIN_DIM_POWER; power <= max_power; power++) {
+        const int dim = 1 << power;
+        const double ops = 2.0 * dim * dim * (double)dim;
+        int *a    = (int *) calloc(dim * dim, sizeof(int));
+        int *b    = (int *) calloc(dim * dim, sizeof(int));
+        int *gold = (int *) calloc(dim * dim, sizeof(int));
+        int *c    = (int *) calloc(dim * dim, sizeof(int));
+        if (!a || !b || !gold || !c) {
+            fprintf(stderr, "Memory allocation failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        init(dim, a);
+        init(dim, b);
+        multiply(dim, a, b, gold);
+
+        const char *best_name = NULL;
+        int best_tile = 0;
+        double best_seconds = 0.0;
+        for (int v = 0; v < NUM_LOOP_ORDERS; v++) {
+            double seconds = time_kernel(&loop_orders[v], 0, dim, a, b, c);
+            if (verify(dim, gold, c) != TRUE) {
+                fprintf(stderr, "Loop order %s disagrees at dim %d\n", loop_orders[v].name, dim);
+            }
+            print_profile_row("kernel", loop_orders[v].name, 0, dim, seconds, ops / seconds / 1e6, "Mop/s");
+            if (best_name == NULL || seconds < best_seconds) {
+                best_name = loop_orders[v].name;
+                best_tile = 0;
+                best_seconds = seconds;
+            }
+        }
+        for (int t = 0; t < NUM_TILE_SIZES; t++) {
+            if (tile_sizes[t] > dim) {
+                break;
+            }
+            double seconds = time_kernel(NULL, tile_sizes[t], dim, a, b, c);
+            if (verify(dim, gold, c) != TRUE) {
+                fprintf(stderr, "Tile %d disagrees at dim %d\n", tile_sizes[t], dim);
+            }
+            print_profile_row("kernel", "tiled", tile_sizes[t], dim, seconds, ops / seconds / 1e6, "Mop/s");
+            if (seconds < best_seconds) {
+                best_name = "tiled";
+                best_tile = tile_sizes[t];
+                best_seconds = seconds;
+            }
+        }
+        print_profile_row("recommend", best_name, best_tile, dim, best_seconds,
+                          ops / best_seconds / 1e6, "Mop/s");
+
+        free(a);
+        free(b);
+        free(gold);
+        free(c);
+    }
+}
+
+/*
+ * Links every slot of an n-element array into one random cycle (Sattolo's
+ * algorithm) so each load depends on the last and the prefetcher cannot
+ * guess the next address.
+ */
+void build_chase_cycle(size_t * const next, const size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        next[i] = i;
+    }
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = (((size_t)rand() << 16) ^ (size_t)rand()) % i;
+        size_t tmp = next[i];
+        next[i] = next[j];
+        next[j] = tmp;
+    }
+}
+
+/* Returns nanoseconds per dependent load for a working set of bytes. */
+double probe_latency(size_t * const next, const size_t bytes) {
+    const size_t n = bytes / sizeof(size_t);
+    build_chase_cycle(next, n);
+    size_t p = 0;
+    for (size_t i = 0; i < n; i++) {
+        p = next[p];
+    }
+    double start = now_seconds();
+    for (long i = 0; i < PROBE_ACCESSES; i++) {
+        p = next[p];
+    }
+    double elapsed = now_seconds() - start;
+    probe_sink = p;
+    return elapsed * 1e9 / PROBE_ACCESSES;
+}
+
+/* Bytes moved per cache line, from sysconf where the host reports it. */
+size_t line_bytes(void) {
+#ifdef _SC_LEVEL1_DCACHE_LINESIZE
+    long bytes = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+    if (bytes > 0) {
+        return (size_t)bytes;
+    }
+#endif
+    return DEFAULT_LINE_BYTES;
 }
 
-int main() {
+/*
+ * Returns MB/s moved through the cache when reading every stride-th int of
+ * bytes. Short strides share each line, so an access costs its stride; once
+ * the stride reaches a line, every access pulls in a whole line.
+ */
+double probe_bandwidth(const int * const data, const size_t bytes, const int stride, double * const seconds) {
+    const size_t n = bytes / sizeof(int);
+    const size_t per_pass = (n + stride - 1) / stride;
+    const long passes = PROBE_ACCESSES / (long)per_pass + 1;
+    size_t sum = 0;
+    double start = now_seconds();
+    for (long pass = 0; pass < passes; pass++) {
+        for (size_t i = 0; i < n; i += stride) {
+            sum += data[i];
+        }
+    }
+    *seconds = now_seconds() - start;
+    probe_sink = sum;
+    const size_t stride_bytes = stride * sizeof(int);
+    const size_t moved = stride_bytes < line_bytes() ? stride_bytes : line_bytes();
+    return passes * per_pass * (double)moved / *seconds / 1e6;
+}
+
+void print_cache_level(const char * const level, const int name) {
+    long bytes = sysconf(name);
+    if (bytes > 0) {
+        print_profile_row("cache", level, 0, bytes, 0.0, 0.0, "bytes");
+    }
+}
+
+void profile_memory(void) {
+    size_t *next = (size_t *) malloc(PROBE_MAX_BYTES);
+    int *data = (int *) malloc(PROBE_MAX_BYTES);
+    if (!next || !data) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < PROBE_MAX_BYTES / sizeof(int); i++) {
+        data[i] = (int)i;
+    }
+
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    print_cache_level("L1d", _SC_LEVEL1_DCACHE_SIZE);
+    print_cache_level("L2", _SC_LEVEL2_CACHE_SIZE);
+    print_cache_level("L3", _SC_LEVEL3_CACHE_SIZE);
+#endif
+
+    /* A rise in latency of LATENCY_JUMP or more marks the largest working
+     * set before the step. Steps are numbered rather than named after cache
+     * levels: TLB reach causes steps too, so compare them with the cache
+     * rows above. */
+    int step = 0;
+    double previous = 0.0;
+    for (size_t bytes = PROBE_MIN_BYTES; bytes <= PROBE_MAX_BYTES; bytes *= 2) {
+        double ns = probe_latency(next, bytes);
+        print_profile_row("latency", "chase", 0, (long)bytes, ns * PROBE_ACCESSES / 1e9, ns, "ns/load");
+        if (previous > 0.0 && ns > previous * LATENCY_JUMP) {
+            print_profile_row("boundary", "step", ++step, (long)bytes / 2, 0.0, previous, "ns/load");
+        }
+        previous = ns;
+    }
+
+    for (int stride = 1; stride <= 64; stride *= 2) {
+        for (size_t bytes = PROBE_MIN_BYTES; bytes <= PROBE_MAX_BYTES; bytes *= 4) {
+            double seconds;
+            double rate = probe_bandwidth(data, bytes, stride, &seconds);
+            print_profile_row("bandwidth", "stride", stride * (int)sizeof(int), (long)bytes, seconds, rate, "MB/s");
+        }
+    }
+
+    free(next);
+    free(data);
+}
+
+void run_profile(const int max_power) {
+    print_profile_header();
+    profile_kernels(max_power);
+    profile_memory();
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "profile") == 0) {
+        int max_power = MAX_DIM_POWER;
+        const char *format = argc >= 3 ? argv[2] : "table";
+        csv_output = (strcmp(format, "csv") == 0);
+        if (argc >= 4) {
+            max_power = atoi(argv[3]);
+        }
+        if (argc > 4 || (!csv_output && strcmp(format, "table") != 0) ||
+            max_power < MIN_DIM_POWER || max_power > MAX_DIM_POWER) {
+            fprintf(stderr, "Usage: %s [profile [table|csv] [max power %d-%d]]\n",
+                    argv[0], MIN_DIM_POWER, MAX_DIM_POWER);
+            return EXIT_FAILURE;
+        }
+        run_profile(max_power);
+        return EXIT_SUCCESS;
+    }
     for (int power = MIN_DIM_POWER; power <= MAX_DIM_POWER; power++) {
         int dim = 1 << power;
         run_test(dim);
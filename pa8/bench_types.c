@@ -0,0 +1,85 @@
+/*
+ * bench_types.c
+ * Throughput of the generic kernels for each element type.
+ * Usage: matrix_bench [dim] [num_workers]
+ * Author: Lawrence Kim - kimevm@bc.edu, Nicholas Hernandez - hernantx@bc.edu
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "matrix_kernels.h"
+#include "matrix_mult.h"
+
+#define BENCH_DIM 512
+
+static double seconds_between(const struct timeval *start, const struct timeval *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec) / 1e6;
+}
+
+static void print_result(const char *type, const char *kernel, int dim,
+                         int num_workers, double seconds, int ok)
+{
+    const double ops = 2.0 * dim * dim * (double)dim;
+    printf("%-4s %-8s %5d %3d %10.6f s %9.3f Gop/s %s\n",
+           type, kernel, dim, num_workers, seconds, ops / seconds / 1e9,
+           ok == 0 ? "ok" : "MISMATCH");
+}
+
+#define BENCH_TYPE(SUFFIX, IN_T, OUT_T)                                        \
+static void bench_##SUFFIX(const int dim, const int num_workers)               \
+{                                                                              \
+    const size_t size = (size_t)dim * dim;                                     \
+    IN_T *a = calloc(size, sizeof(IN_T));                                      \
+    IN_T *b = calloc(size, sizeof(IN_T));                                      \
+    OUT_T *gold = calloc(size, sizeof(OUT_T));                                 \
+    OUT_T *c = calloc(size, sizeof(OUT_T));                                    \
+    if (!a || !b || !gold || !c) {                                             \
+        perror("calloc");                                                      \
+        exit(EXIT_FAILURE);                                                    \
+    }                                                                          \
+    struct timeval start, end;                                                 \
+    matrix_init_##SUFFIX(a, dim);                                              \
+    matrix_init_##SUFFIX(b, dim);                                              \
+    gettimeofday(&start, NULL);                                                \
+    matrix_multiply_reference_##SUFFIX(a, b, gold, dim);                       \
+    gettimeofday(&end, NULL);                                                  \
+    print_result(#SUFFIX, "naive", dim, 1, seconds_between(&start, &end), 0);  \
+    gettimeofday(&start, NULL);                                                \
+    matrix_multiply_chunk_##SUFFIX(a, b, c, dim, 0, dim);                      \
+    gettimeofday(&end, NULL);                                                  \
+    print_result(#SUFFIX, "tiled", dim, 1, seconds_between(&start, &end),      \
+                 matrix_verify_##SUFFIX(c, gold, dim));                        \
+    gettimeofday(&start, NULL);                                                \
+    matrix_multiply_threads_##SUFFIX(a, b, c, dim, num_workers);               \
+    gettimeofday(&end, NULL);                                                  \
+    print_result(#SUFFIX, "threads", dim, num_workers,                         \
+                 seconds_between(&start, &end),                                \
+                 matrix_verify_##SUFFIX(c, gold, dim));                        \
+    free(a);                                                                   \
+    free(b);                                                                   \
+    free(gold);                                                                \
+    free(c);                                                                   \
+}
+
+BENCH_TYPE(f64, double,  double)
+BENCH_TYPE(f32, float,   float)
+BENCH_TYPE(i32, int32_t, int32_t)
+BENCH_TYPE(i8,  int8_t,  int32_t)
+
+int main(int argc, char *argv[])
+{
+    const int dim = argc > 1 ? atoi(argv[1]) : BENCH_DIM;
+    const int num_workers = argc > 2 ? atoi(argv[2]) : matrix_default_workers();
+    if (dim <= 0 || num_workers <= 0) {
+        fprintf(stderr, "Usage: %s [dim] [num_workers]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    printf("type kernel     dim  nw       time        throughput\n");
+    bench_f64(dim, num_workers);
+    bench_f32(dim, num_workers);
+    bench_i32(dim, num_workers);
+    bench_i8(dim, num_workers);
+    return EXIT_SUCCESS;
+}
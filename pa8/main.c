@@ -1,14 +1,28 @@
 /*
  * main.c
  * Driver for demonstration of parallelized matrix multiplication.
+ * Usage: matrix_mult [huge|small|both] [a_file b_file]
+ *        matrix_mult tune [dim]
+ *        matrix_mult chain
+ * The optional files each hold DIM * DIM doubles in row-major order; without
+ * them the inputs are generated. tune benchmarks the candidate kernels for
+ * dim's size class and caches the fastest, which later runs start from.
+ * chain multiplies a fixed chain of rectangular matrices in the cheapest
+ * order and checks it against the left-to-right product.
  * Author: Amittai Aviram - aviram@bc.edu
  */
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 
+#include "matrix_buffer.h"
+#include "matrix_chain.h"
+#include "matrix_kernels.h"
 #include "matrix_mult.h"
+#include "matrix_tune.h"
 
 typedef struct RunArgs {
     multiply_function func;
@@ -18,21 +32,167 @@ typedef struct RunArgs {
     const bool verify;
 } RunArgs;
 
+static double *alloc_matrix(size_t bytes, const char *name)
+{
+    PageBacking backing;
+    double *m = buffer_alloc(bytes, false, &backing);
+    printf("Matrix %s: %s.\n", name, page_backing_name(backing));
+    return m;
+}
+
+static void fill_matrix(Matrix *m)
+{
+    for (size_t i = 0; i < (size_t)m->rows * m->cols; ++i) {
+        m->data[i] = (double)((i * 7 + 3) % MATRIX_INIT_SPAN - MATRIX_INIT_SPAN / 2);
+    }
+}
+static void multiply_reference(const Matrix *a, const Matrix *b, Matrix *c)
+{
+    c->rows = a->rows;
+    c->cols = b->cols;
+    c->data = buffer_alloc((size_t)c->rows * c->cols * sizeof(double), false, NULL);
+    for (int i = 0; i < a->rows; ++i) {
+        for (int k = 0; k < a->cols; ++k) {
+            const double a_ik = a->data[(size_t)i * a->cols + k];
+            for (int j = 0; j < b->cols; ++j) {
+                c->data[(size_t)i * c->cols + j] += a_ik * b->data[(size_t)k * b->cols + j];
+            }
+        }
+    }
+}
+static bool same_matrix(const Matrix *m1, const Matrix *m2)
+{
+    if (m1->rows != m2->rows || m1->cols != m2->cols) {
+        return false;
+    }
+    for (size_t i = 0; i < (size_t)m1->rows * m1->cols; ++i) {
+        const double scale = fabs(m2->data[i]) > 1.0 ? fabs(m2->data[i]) : 1.0;
+        if (fabs(m1->data[i] - m2->data[i]) > MATRIX_TOLERANCE_f64 * scale) {
+            return false;
+        }
+    }
+    return true;
+}
+static void free_matrix(Matrix *m)
+{
+    buffer_free(m->data, (size_t)m->rows * m->cols * sizeof(double));
+}
+/*
+ * Multiplies a chain twice with one scratch pool, so the second run shows
+ * the pool's buffers being reused rather than allocated.
+ */
+static int run_chain(void)
+{
+    const int dims[] = {DIM, DIM / 16, DIM, DIM / 8, DIM / 2, DIM};
+    const int count = sizeof(dims) / sizeof(dims[0]) - 1;
+    const int workers = tune_config(DIM)->workers;
+    Matrix matrices[sizeof(dims) / sizeof(dims[0]) - 1];
+    ScratchPool pool;
+    ChainStats stats;
+    Matrix result, gold;
+    bool ok = true;
+    for (int i = 0; i < count; ++i) {
+        matrices[i] = (Matrix){ .data = NULL, .rows = dims[i], .cols = dims[i + 1] };
+        matrices[i].data = buffer_alloc((size_t)dims[i] * dims[i + 1] * sizeof(double),
+                                        false, NULL);
+        fill_matrix(&matrices[i]);
+    }
+    gold = matrices[0];
+    for (int i = 1; i < count; ++i) {
+        Matrix next;
+        multiply_reference(&gold, &matrices[i], &next);
+        if (i > 1) {
+            free_matrix(&gold);
+        }
+        gold = next;
+    }
+    scratch_pool_init(&pool);
+    for (int pass = 1; pass <= 2; ++pass) {
+        struct timeval start, end;
+        const int allocations = pool.allocations;
+        const int reuses = pool.reuses;
+        gettimeofday(&start, NULL);
+        chain_multiply(matrices, count, workers, &pool, &result, &stats);
+        gettimeofday(&end, NULL);
+        printf("Chain order %s: %.0f multiplications, %.0f left to right.\n",
+               stats.order, stats.multiplications,
+               stats.left_to_right_multiplications);
+        printf("Scratch pool: %d buffers allocated, %d reused, peak %zu of %zu bytes.\n",
+               pool.allocations - allocations, pool.reuses - reuses, pool.peak_bytes,
+               pool.allocated_bytes);
+        print_elapsed_time(&start, &end, "chain");
+        ok = ok && same_matrix(&result, &gold);
+        printf("Verification for chain: %s.\n",
+               same_matrix(&result, &gold) ? "success" : "failure");
+        free_matrix(&result);
+    }
+    scratch_pool_destroy(&pool);
+    free_matrix(&gold);
+    for (int i = 0; i < count; ++i) {
+        free_matrix(&matrices[i]);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Loads both inputs and multiplies them in one pass. All three figures are
+ * wall-clock; the workers multiply early panels while later ones still load,
+ * so the time to the last input overlaps the compute time.
+ */
+static void run_pipelined(const MatrixSource *a_source,
+                          const MatrixSource *b_source,
+                          const double *gold,
+                          size_t bytes)
+{
+    const char *name = "pipelined threads";
+    const int workers = tune_config(DIM)->workers;
+    PipelineTimes times;
+    double *a = alloc_matrix(bytes, "pipelined a");
+    double *b = alloc_matrix(bytes, "pipelined b");
+    double *c = alloc_matrix(bytes, name);
+    printf("Algorithm: %s with %d worker%s.\n",
+           name, workers, (workers == 1 ? "" : "s"));
+    multiply_pipelined(a_source, b_source, a, b, c, DIM, workers, &times);
+    print_elapsed_time(&times.start, &times.inputs_ready, "pipelined inputs, to the last panel");
+    print_elapsed_time(&times.compute_start, &times.end, "pipelined compute");
+    print_elapsed_time(&times.start, &times.end, name);
+    print_verification(c, gold, DIM, name);
+    buffer_free(c, bytes);
+    buffer_free(b, bytes);
+    buffer_free(a, bytes);
+}
 
-int main(void) {
-    int size = DIM * DIM;
-    double * matrix_a = calloc(size, sizeof(double));
-    double * matrix_b = calloc(size, sizeof(double));
-    init_matrix(matrix_a, DIM);
-    init_matrix(matrix_b, DIM);
+static void run_all(bool huge_pages,
+                    const MatrixSource *a_source,
+                    const MatrixSource *b_source)
+{
+    const size_t bytes = (size_t)DIM * DIM * sizeof(double);
+    struct timeval start, end;
+    char tuned[128];
+    const TuneConfig *config = tune_config(DIM);
+    buffer_set_huge_pages(huge_pages);
+    printf("==== %s pages ====\n", huge_pages ? "Huge" : "Small");
+    tune_describe(config, tuned, sizeof(tuned));
+    printf("Tuned configuration: %s (%s).\n",
+           tuned, config->from_cache ? "cached" : "default");
+    gettimeofday(&start, NULL);
+    double * matrix_a = alloc_matrix(bytes, "a");
+    double * matrix_b = alloc_matrix(bytes, "b");
+    load_matrix(a_source, matrix_a, DIM, config->workers);
+    load_matrix(b_source, matrix_b, DIM, config->workers);
+    gettimeofday(&end, NULL);
+    print_elapsed_time(&start, &end, "setup");
+    double *gold = alloc_matrix(bytes, "reference");
+    matrix_multiply_reference_f64(matrix_a, matrix_b, gold, DIM);
     RunArgs args[] = {
-        {multiply_serial, NULL, 1, "serial", false},
-        {multiply_parallel_processes, NULL, NUM_WORKERS, "parallel processes", true},
-        {multiply_parallel_threads, NULL, NUM_WORKERS, "parallel threads", true}
+        {multiply_serial, NULL, 1, "serial", true},
+        {multiply_parallel_processes, NULL, TUNED_WORKERS, "parallel processes", true},
+        {multiply_parallel_threads, NULL, TUNED_WORKERS, "parallel threads", true},
+        {multiply_tuned, NULL, TUNED_WORKERS, "tuned", true}
     };
     const int num_functions = sizeof(args) / sizeof(args[0]);
     for (int i = 0; i < num_functions; ++i) {
-       args[i].product = calloc(size, sizeof(double));
+       args[i].product = alloc_matrix(bytes, args[i].name);
     }
     for (int i = 0; i < num_functions; ++i) {
         run_and_time(
@@ -40,16 +200,54 @@ int main(void) {
                 matrix_a,
                 matrix_b,
                 args[i].product,
-                args[0].product,
+                gold,
                 DIM,
                 args[i].name,
                 args[i].num_workers,
                 args[i].verify
                 );
     }
+    run_pipelined(a_source, b_source, gold, bytes);
     for (int i = 0; i < num_functions; ++i) {
-        free(args[i].product);
+        buffer_free(args[i].product, bytes);
     }
-    return EXIT_SUCCESS;
+    buffer_free(gold, bytes);
+    buffer_free(matrix_a, bytes);
+    buffer_free(matrix_b, bytes);
 }
 
+int main(int argc, char *argv[]) {
+    const char *mode = argc > 1 ? argv[1] : "huge";
+    MatrixSource a_source, b_source;
+    if (strcmp(mode, "chain") == 0 && argc == 2) {
+        return run_chain();
+    }
+    if (strcmp(mode, "tune") == 0 && argc <= 3) {
+        const int dim = argc == 3 ? atoi(argv[2]) : DIM;
+        if (dim < 1) {
+            fprintf(stderr, "Usage: %s tune [dim]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return autotune(dim) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc != 1 && argc != 2 && argc != 4) {
+        fprintf(stderr, "Usage: %s [huge|small|both] [a_file b_file]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    matrix_source_open(&a_source, argc == 4 ? argv[2] : NULL, DIM);
+    matrix_source_open(&b_source, argc == 4 ? argv[3] : NULL, DIM);
+    if (strcmp(mode, "huge") == 0) {
+        run_all(true, &a_source, &b_source);
+    } else if (strcmp(mode, "small") == 0) {
+        run_all(false, &a_source, &b_source);
+    } else if (strcmp(mode, "both") == 0) {
+        run_all(false, &a_source, &b_source);
+        run_all(true, &a_source, &b_source);
+    } else {
+        fprintf(stderr, "Usage: %s [huge|small|both] [a_file b_file]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    matrix_source_close(&a_source);
+    matrix_source_close(&b_source);
+    return EXIT_SUCCESS;
+}
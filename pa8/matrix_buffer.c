@@ -0,0 +1,128 @@
+/*
+ * matrix_buffer.c
+ * Author: Lawrence Kim - kimevm@bc.edu, Nicholas Hernandez - hernantx@bc.edu
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "matrix_buffer.h"
+
+static bool use_huge_pages = true;
+
+void buffer_set_huge_pages(bool enabled)
+{
+    use_huge_pages = enabled;
+}
+/*
+ * True if the THP policy in path lets an MADV_HUGEPAGE region get huge pages,
+ * i.e. the bracketed setting is neither "never" nor "deny". Private memory
+ * follows "enabled" and shared anonymous memory follows "shmem_enabled".
+ */
+static bool thp_allowed(const char *path)
+{
+    char line[128];
+    bool allowed = false;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    if (fgets(line, sizeof(line), file) != NULL) {
+        const char *open = strchr(line, '[');
+        allowed = open != NULL && strncmp(open, "[never]", 7) != 0
+                  && strncmp(open, "[deny]", 6) != 0;
+    }
+    fclose(file);
+    return allowed;
+}
+/* Every mapping is a whole number of huge pages so buffer_free needs no state. */
+static size_t mapped_length(size_t bytes)
+{
+    return (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+static void *map_anonymous(size_t length, int flags)
+{
+    void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | flags, -1, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+static void *map_checked(size_t length, int flags)
+{
+    void *addr = map_anonymous(length, flags);
+    if (addr == NULL) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    return addr;
+}
+/* Over-maps by one huge page and trims both ends to a 2 MiB boundary. */
+static void *map_aligned(size_t length, int flags)
+{
+    char *raw = map_checked(length + HUGE_PAGE_SIZE, flags);
+    uintptr_t start = ((uintptr_t)raw + HUGE_PAGE_SIZE - 1)
+                      & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    size_t head = start - (uintptr_t)raw;
+    size_t tail = HUGE_PAGE_SIZE - head;
+    if (head > 0) {
+        munmap(raw, head);
+    }
+    if (tail > 0) {
+        munmap((char *)start + length, tail);
+    }
+    return (void *)start;
+}
+void *buffer_alloc(size_t bytes, bool shared, PageBacking *backing)
+{
+    const size_t length = mapped_length(bytes);
+    const int sharing = shared ? MAP_SHARED : MAP_PRIVATE;
+    PageBacking used = PAGES_SMALL;
+    void *addr = NULL;
+    if (use_huge_pages) {
+#ifdef MAP_HUGETLB
+        addr = map_anonymous(length, sharing | MAP_HUGETLB);
+        used = PAGES_HUGETLB;
+#endif
+        if (addr == NULL) {
+            addr = map_aligned(length, sharing);
+            used = PAGES_SMALL;
+#ifdef MADV_HUGEPAGE
+            const char *policy = shared
+                ? "/sys/kernel/mm/transparent_hugepage/shmem_enabled"
+                : "/sys/kernel/mm/transparent_hugepage/enabled";
+            if (madvise(addr, length, MADV_HUGEPAGE) == 0 && thp_allowed(policy)) {
+                used = PAGES_THP;
+            }
+#endif
+        }
+    } else {
+        addr = map_checked(length, sharing);
+#ifdef MADV_NOHUGEPAGE
+        madvise(addr, length, MADV_NOHUGEPAGE);
+#endif
+    }
+    if (backing != NULL) {
+        *backing = used;
+    }
+    return addr;
+}
+void buffer_free(void *addr, size_t bytes)
+{
+    if (addr != NULL && munmap(addr, mapped_length(bytes)) < 0) {
+        perror("munmap");
+        exit(EXIT_FAILURE);
+    }
+}
+const char *page_backing_name(PageBacking backing)
+{
+    switch (backing) {
+    case PAGES_HUGETLB:
+        return "hugetlbfs pages";
+    case PAGES_THP:
+        return "transparent huge pages";
+    default:
+        return "4 KiB pages";
+    }
+}
@@ -0,0 +1,31 @@
+/*
+ * matrix_buffer.h
+ * Page-aligned matrix buffers backed by huge pages where the host allows.
+ * Author: Lawrence Kim - kimevm@bc.edu, Nicholas Hernandez - hernantx@bc.edu
+ */
+#ifndef MATRIX_BUFFER_H
+#define MATRIX_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+typedef enum {
+    PAGES_SMALL,    /* ordinary 4 KiB pages */
+    PAGES_HUGETLB,  /* reserved hugetlbfs pages via MAP_HUGETLB */
+    PAGES_THP       /* 2 MiB-aligned mapping advised with MADV_HUGEPAGE */
+} PageBacking;
+
+/* Selects whether later buffer_alloc calls try huge pages (default: yes). */
+void buffer_set_huge_pages(bool enabled);
+/*
+ * Returns zeroed memory of at least bytes, shared across fork when shared is
+ * set. Tries MAP_HUGETLB, then THP, then small pages; backing, if not NULL,
+ * reports which one was used. Exits on failure.
+ */
+void *buffer_alloc(size_t bytes, bool shared, PageBacking *backing);
+void buffer_free(void *addr, size_t bytes);
+const char *page_backing_name(PageBacking backing);
+
+#endif
@@ -0,0 +1,356 @@
+/*
+ * matrix_chain.c
+ * The chosen parenthesization is a binary tree whose leaves are the inputs.
+ * Every product node is cut into MATRIX_TILE-row panels; a node's panels
+ * are queued as soon as both of its children are complete, so independent
+ * sub-products run side by side while large ones still spread across all
+ * workers. Before running, the tree is walked once in serial order against
+ * the scratch pool so it holds the buffers that order needs; buffers go
+ * back to the pool as soon as the product that read them is done.
+ * Author: Lawrence Kim - kimevm@bc.edu, Nicholas Hernandez - hernantx@bc.edu
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "matrix_buffer.h"
+#include "matrix_chain.h"
+#include "matrix_kernels.h"
+
+#define MAX_NODES (2 * CHAIN_MAX_MATRICES - 1)
+
+typedef struct {
+    bool leaf;
+    int left;
+    int right;
+    int parent;
+    int rows;
+    int inner;
+    int cols;
+    double *data;
+    int children_left;
+    int panels_left;
+} ChainNode;
+
+typedef struct {
+    int node;
+    int row_start;
+    int rows;
+} ChainTask;
+
+typedef struct {
+    ChainNode nodes[MAX_NODES];
+    int num_nodes;
+    int root;
+    ChainTask *tasks;
+    int head;
+    int tail;
+    bool done;
+    ScratchPool *pool;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+} ChainRun;
+
+void scratch_pool_init(ScratchPool *pool)
+{
+    memset(pool, 0, sizeof(*pool));
+}
+static ScratchBuffer *scratch_add(ScratchPool *pool, size_t bytes)
+{
+    if (pool->count == pool->cap) {
+        pool->cap = pool->cap ? pool->cap * 2 : 8;
+        pool->buffers = realloc(pool->buffers, pool->cap * sizeof(ScratchBuffer));
+        if (pool->buffers == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ScratchBuffer *buffer = &pool->buffers[pool->count++];
+    buffer->capacity = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    buffer->data = buffer_alloc(buffer->capacity, false, NULL);
+    buffer->in_use = false;
+    buffer->used = false;
+    pool->allocated_bytes += buffer->capacity;
+    pool->allocations++;
+    return buffer;
+}
+void scratch_pool_reserve(ScratchPool *pool, size_t bytes, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        scratch_add(pool, bytes);
+    }
+}
+void scratch_pool_destroy(ScratchPool *pool)
+{
+    for (int i = 0; i < pool->count; ++i) {
+        buffer_free(pool->buffers[i].data, pool->buffers[i].capacity);
+    }
+    free(pool->buffers);
+    memset(pool, 0, sizeof(*pool));
+}
+/*
+ * Takes the smallest free buffer that fits, allocating one if none does.
+ * Planning only reserves, so it does not count toward reuses.
+ */
+static double *scratch_acquire(ScratchPool *pool, size_t bytes, bool planning)
+{
+    ScratchBuffer *best = NULL;
+    for (int i = 0; i < pool->count; ++i) {
+        ScratchBuffer *buffer = &pool->buffers[i];
+        if (!buffer->in_use && buffer->capacity >= bytes &&
+            (best == NULL || buffer->capacity < best->capacity)) {
+            best = buffer;
+        }
+    }
+    if (best == NULL) {
+        best = scratch_add(pool, bytes);
+    } else if (best->used && !planning) {
+        pool->reuses++;
+    }
+    best->in_use = true;
+    best->used = best->used || !planning;
+    pool->live_bytes += best->capacity;
+    if (pool->live_bytes > pool->peak_bytes) {
+        pool->peak_bytes = pool->live_bytes;
+    }
+    return best->data;
+}
+static void scratch_release(ScratchPool *pool, void *data)
+{
+    for (int i = 0; i < pool->count; ++i) {
+        if (pool->buffers[i].data == data) {
+            pool->buffers[i].in_use = false;
+            pool->live_bytes -= pool->buffers[i].capacity;
+            return;
+        }
+    }
+}
+double chain_order(const int *dims, int count, int *split)
+{
+    double *cost = matrix_xmalloc(sizeof(double) * count * count);
+    for (int i = 0; i < count; ++i) {
+        cost[i * count + i] = 0.0;
+        split[i * count + i] = i;
+    }
+    for (int length = 2; length <= count; ++length) {
+        for (int i = 0; i + length - 1 < count; ++i) {
+            const int j = i + length - 1;
+            cost[i * count + j] = -1.0;
+            for (int k = i; k < j; ++k) {
+                const double c = cost[i * count + k] + cost[(k + 1) * count + j]
+                                 + (double)dims[i] * dims[k + 1] * dims[j + 1];
+                if (cost[i * count + j] < 0.0 || c < cost[i * count + j]) {
+                    cost[i * count + j] = c;
+                    split[i * count + j] = k;
+                }
+            }
+        }
+    }
+    const double best = cost[count - 1];
+    free(cost);
+    return best;
+}
+static size_t node_bytes(const ChainNode *node)
+{
+    return (size_t)node->rows * node->cols * sizeof(double);
+}
+static int build_tree(ChainRun *run,
+                      const Matrix *matrices,
+                      const int *split,
+                      int count,
+                      int i,
+                      int j,
+                      char *order,
+                      size_t order_size)
+{
+    const int index = run->num_nodes++;
+    ChainNode *node = &run->nodes[index];
+    memset(node, 0, sizeof(*node));
+    node->parent = -1;
+    if (i == j) {
+        node->leaf = true;
+        node->rows = matrices[i].rows;
+        node->cols = matrices[i].cols;
+        node->data = matrices[i].data;
+        snprintf(order + strlen(order), order_size - strlen(order), "A%d", i + 1);
+        return index;
+    }
+    const int k = split[i * count + j];
+    strncat(order, "(", order_size - strlen(order) - 1);
+    node->left = build_tree(run, matrices, split, count, i, k, order, order_size);
+    strncat(order, " ", order_size - strlen(order) - 1);
+    node->right = build_tree(run, matrices, split, count, k + 1, j, order, order_size);
+    strncat(order, ")", order_size - strlen(order) - 1);
+    node = &run->nodes[index];
+    node->rows = run->nodes[node->left].rows;
+    node->inner = run->nodes[node->left].cols;
+    node->cols = run->nodes[node->right].cols;
+    node->children_left = !run->nodes[node->left].leaf + !run->nodes[node->right].leaf;
+    node->panels_left = (node->rows + MATRIX_TILE - 1) / MATRIX_TILE;
+    run->nodes[node->left].parent = index;
+    run->nodes[node->right].parent = index;
+    return index;
+}
+/* Acquires and releases in serial post-order so the pool fits that order. */
+static void plan_buffers(ChainRun *run, int index)
+{
+    ChainNode *node = &run->nodes[index];
+    if (node->leaf) {
+        return;
+    }
+    plan_buffers(run, node->left);
+    plan_buffers(run, node->right);
+    if (index != run->root) {
+        node->data = scratch_acquire(run->pool, node_bytes(node), true);
+    }
+    for (int side = 0; side < 2; ++side) {
+        ChainNode *child = &run->nodes[side == 0 ? node->left : node->right];
+        if (!child->leaf) {
+            scratch_release(run->pool, child->data);
+            child->data = NULL;
+        }
+    }
+}
+/* Called with run->lock held once both children of index are complete. */
+static void node_ready(ChainRun *run, int index)
+{
+    ChainNode *node = &run->nodes[index];
+    if (index != run->root) {
+        node->data = scratch_acquire(run->pool, node_bytes(node), false);
+    }
+    for (int row = 0; row < node->rows; row += MATRIX_TILE) {
+        const int rows = row + MATRIX_TILE < node->rows ? MATRIX_TILE : node->rows - row;
+        run->tasks[run->tail++] = (ChainTask){ .node = index, .row_start = row, .rows = rows };
+    }
+    pthread_cond_broadcast(&run->work);
+}
+static void node_done(ChainRun *run, int index)
+{
+    ChainNode *node = &run->nodes[index];
+    for (int side = 0; side < 2; ++side) {
+        ChainNode *child = &run->nodes[side == 0 ? node->left : node->right];
+        if (!child->leaf) {
+            scratch_release(run->pool, child->data);
+        }
+    }
+    if (index == run->root) {
+        run->done = true;
+        pthread_cond_broadcast(&run->work);
+    } else if (--run->nodes[node->parent].children_left == 0) {
+        node_ready(run, node->parent);
+    }
+}
+static void *chain_worker(void *arg)
+{
+    ChainRun *run = (ChainRun *)arg;
+    pthread_mutex_lock(&run->lock);
+    for (;;) {
+        while (run->head == run->tail && !run->done) {
+            pthread_cond_wait(&run->work, &run->lock);
+        }
+        if (run->head == run->tail) {
+            break;
+        }
+        const ChainTask task = run->tasks[run->head++];
+        ChainNode *node = &run->nodes[task.node];
+        pthread_mutex_unlock(&run->lock);
+        matrix_multiply_rect_f64(run->nodes[node->left].data, run->nodes[node->right].data,
+                                 node->data, node->inner, node->cols, task.row_start,
+                                 task.rows, MATRIX_TILE);
+        pthread_mutex_lock(&run->lock);
+        if (--node->panels_left == 0) {
+            node_done(run, task.node);
+        }
+    }
+    pthread_mutex_unlock(&run->lock);
+    return NULL;
+}
+void chain_multiply(const Matrix *matrices,
+                    int count,
+                    int num_workers,
+                    ScratchPool *pool,
+                    Matrix *result,
+                    ChainStats *stats)
+{
+    int dims[CHAIN_MAX_MATRICES + 1];
+    if (count < 1 || count > CHAIN_MAX_MATRICES) {
+        fprintf(stderr, "chain_multiply: %d matrices; expected 1 to %d.\n",
+                count, CHAIN_MAX_MATRICES);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; ++i) {
+        if (i > 0 && matrices[i].rows != matrices[i - 1].cols) {
+            fprintf(stderr, "chain_multiply: A%d is %d x %d but A%d has %d rows.\n",
+                    i, matrices[i - 1].rows, matrices[i - 1].cols,
+                    i + 1, matrices[i].rows);
+            exit(EXIT_FAILURE);
+        }
+        dims[i] = matrices[i].rows;
+    }
+    dims[count] = matrices[count - 1].cols;
+
+    ChainRun *run = matrix_xmalloc(sizeof(ChainRun));
+    int *split = matrix_xmalloc(sizeof(int) * count * count);
+    memset(run, 0, sizeof(*run));
+    run->pool = pool;
+    stats->order[0] = '\0';
+    stats->multiplications = chain_order(dims, count, split);
+    stats->left_to_right_multiplications = 0.0;
+    for (int j = 1; j < count; ++j) {
+        stats->left_to_right_multiplications += (double)dims[0] * dims[j] * dims[j + 1];
+    }
+    run->root = build_tree(run, matrices, split, count, 0, count - 1,
+                           stats->order, sizeof(stats->order));
+    free(split);
+
+    result->rows = dims[0];
+    result->cols = dims[count];
+    result->data = buffer_alloc((size_t)result->rows * result->cols * sizeof(double),
+                                false, NULL);
+    if (count == 1) {
+        memcpy(result->data, matrices[0].data,
+               (size_t)result->rows * result->cols * sizeof(double));
+        free(run);
+        return;
+    }
+
+    plan_buffers(run, run->root);
+    pool->peak_bytes = pool->live_bytes;
+    int num_tasks = 0;
+    for (int i = 0; i < run->num_nodes; ++i) {
+        num_tasks += run->nodes[i].leaf ? 0 : run->nodes[i].panels_left;
+    }
+    run->tasks = matrix_xmalloc(sizeof(ChainTask) * num_tasks);
+    run->nodes[run->root].data = result->data;
+    pthread_mutex_init(&run->lock, NULL);
+    pthread_cond_init(&run->work, NULL);
+    pthread_mutex_lock(&run->lock);
+    for (int i = 0; i < run->num_nodes; ++i) {
+        if (!run->nodes[i].leaf && run->nodes[i].children_left == 0) {
+            node_ready(run, i);
+        }
+    }
+    pthread_mutex_unlock(&run->lock);
+
+    pthread_t *tids = matrix_xmalloc(sizeof(pthread_t) * num_workers);
+    for (int id = 0; id < num_workers - 1; ++id) {
+        if (pthread_create(&tids[id], NULL, chain_worker, run) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    chain_worker(run);
+    for (int id = 0; id < num_workers - 1; ++id) {
+        if (pthread_join(tids[id], NULL) != 0) {
+            perror("pthread_join");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(tids);
+    pthread_cond_destroy(&run->work);
+    pthread_mutex_destroy(&run->lock);
+    free(run->tasks);
+    free(run);
+}
@@ -0,0 +1,73 @@
+/*
+ * matrix_chain.h
+ * Products of several double-precision matrices of compatible shapes,
+ * parenthesized by dynamic programming to minimize multiplications and
+ * computed on a pool of threads with intermediates from a scratch pool.
+ * Author: Lawrence Kim - kimevm@bc.edu, Nicholas Hernandez - hernantx@bc.edu
+ */
+#ifndef MATRIX_CHAIN_H
+#define MATRIX_CHAIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CHAIN_MAX_MATRICES 64
+
+typedef struct {
+    double *data;   /* row-major */
+    int rows;
+    int cols;
+} Matrix;
+
+typedef struct {
+    void *data;
+    size_t capacity;
+    bool in_use;
+    bool used;      /* has held a product, so taking it again is a reuse */
+} ScratchBuffer;
+
+/*
+ * Intermediate products are taken from and returned to the pool, which can
+ * be kept across chain_multiply calls so later chains allocate nothing.
+ */
+typedef struct {
+    ScratchBuffer *buffers;
+    int count;
+    int cap;
+    size_t allocated_bytes;
+    size_t live_bytes;
+    size_t peak_bytes;
+    int allocations;
+    int reuses;
+} ScratchPool;
+
+typedef struct {
+    double multiplications;             /* for the chosen order */
+    double left_to_right_multiplications;
+    char order[CHAIN_MAX_MATRICES * 8];  /* e.g. "((A1 A2) A3)" */
+} ChainStats;
+
+void scratch_pool_init(ScratchPool *pool);
+/* Adds count free buffers of at least bytes each. */
+void scratch_pool_reserve(ScratchPool *pool, size_t bytes, int count);
+void scratch_pool_destroy(ScratchPool *pool);
+
+/*
+ * Fills split so that split[i * count + j] is the k where the cheapest
+ * product of matrices i..j divides into (i..k)(k+1..j), and returns its
+ * number of scalar multiplications. Matrix i is dims[i] x dims[i + 1].
+ */
+double chain_order(const int *dims, int count, int *split);
+/*
+ * Multiplies matrices[0] through matrices[count - 1] on num_workers
+ * threads into result, whose data is allocated with buffer_alloc and
+ * freed by the caller with buffer_free. Exits if the shapes do not chain.
+ */
+void chain_multiply(const Matrix *matrices,
+                    int count,
+                    int num_workers,
+                    ScratchPool *pool,
+                    Matrix *result,
+                    ChainStats *stats);
+
+#endif
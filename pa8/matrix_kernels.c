@@ -0,0 +1,91 @@
+/*
+ * matrix_kernels.c
+ * Library copies of the element-type-generic kernels and the thread driver
+ * they share.
+ * Author: Lawrence Kim - kimevm@bc.edu, Nicholas Hernandez - hernantx@bc.edu
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "matrix_kernels.h"
+
+typedef struct {
+    chunk_function chunk_fn;
+    const void *a;
+    const void *b;
+    void *c;
+    int dim;
+    int row_start;
+    int chunk;
+} ChunkArgs;
+
+DEFINE_MATRIX_KERNELS(, f64, double,  double)
+DEFINE_MATRIX_KERNELS(, f32, float,   float)
+DEFINE_MATRIX_KERNELS(, i32, int32_t, int32_t)
+DEFINE_MATRIX_KERNELS(, i8,  int8_t,  int32_t)
+DEFINE_MATRIX_THREADS(f64, double,  double)
+DEFINE_MATRIX_THREADS(f32, float,   float)
+DEFINE_MATRIX_THREADS(i32, int32_t, int32_t)
+DEFINE_MATRIX_THREADS(i8,  int8_t,  int32_t)
+
+void *matrix_xmalloc(size_t nbytes)
+{
+    void *p = malloc(nbytes);
+    if (p == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+int matrix_default_workers(void)
+{
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus < MATRIX_MAX_WORKERS ? (int)cpus : MATRIX_MAX_WORKERS;
+}
+static void *chunk_task(void *arg)
+{
+    ChunkArgs *p = (ChunkArgs *)arg;
+    p->chunk_fn(p->a, p->b, p->c, p->dim, p->row_start, p->chunk);
+    return NULL;
+}
+void run_chunks_threaded(chunk_function chunk_fn,
+                         const void * const a,
+                         const void * const b,
+                         void * const c,
+                         const int dim,
+                         const int num_workers)
+{
+    pthread_t *tids = (pthread_t *)matrix_xmalloc(sizeof(pthread_t) * num_workers);
+    ChunkArgs *arg_set = (ChunkArgs *)matrix_xmalloc(sizeof(ChunkArgs) * num_workers);
+    const int chunk = dim / num_workers;
+    int row = 0;
+    for (int i = 0; i < num_workers; ++i) {
+        arg_set[i] = (ChunkArgs){ .chunk_fn = chunk_fn, .a = a, .b = b, .c = c,
+                                  .dim = dim, .row_start = row,
+                                  .chunk = (i == num_workers - 1)
+                                           ? (dim - row) : chunk };
+        row += chunk;
+    }
+    const int num_threads = num_workers - 1;
+    for (int id = 0; id < num_threads; ++id) {
+        if (pthread_create(&tids[id], NULL, chunk_task, &arg_set[id]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    chunk_task(&arg_set[num_workers - 1]);
+    for (int id = 0; id < num_threads; ++id) {
+        if (pthread_join(tids[id], NULL) != 0) {
+            perror("pthread_join");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(arg_set);
+    free(tids);
+}
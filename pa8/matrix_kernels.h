@@ -0,0 +1,188 @@
+/*
+ * matrix_kernels.h
+ * Element-type-generic matrix multiplication kernels.
+ * DEFINE_MATRIX_KERNELS stamps out one copy of the tiled kernel, reference
+ * kernel, initializer and verifier for an input type and an accumulator
+ * type; all copies share MATRIX_TILE and the tolerance table below. These
+ * are self-contained, so single-file programs can stamp private copies.
+ * DEFINE_MATRIX_THREADS adds the threaded wrapper, which needs the
+ * type-erased thread driver in matrix_kernels.c.
+ * Author: Lawrence Kim - kimevm@bc.edu, Nicholas Hernandez - hernantx@bc.edu
+ */
+#ifndef MATRIX_KERNELS_H
+#define MATRIX_KERNELS_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MATRIX_TILE   64
+#define MATRIX_INIT_SPAN 11
+#define MATRIX_MAX_WORKERS 64
+
+/* Largest |difference| accepted by verify, relative to max(1, |expected|). */
+#define MATRIX_TOLERANCE_f64 1e-9
+#define MATRIX_TOLERANCE_f32 1e-5
+#define MATRIX_TOLERANCE_i32 0.0
+#define MATRIX_TOLERANCE_i8  0.0
+#define MATRIX_TOLERANCE_int 0.0
+
+typedef void (*chunk_function)(const void * const a,
+                               const void * const b,
+                               void * const c,
+                               const int dim,
+                               const int row_start,
+                               const int chunk);
+
+/* malloc that exits on failure. */
+void *matrix_xmalloc(size_t nbytes);
+/* One worker per online CPU, at most MATRIX_MAX_WORKERS. */
+int matrix_default_workers(void);
+
+/* Runs chunk over dim rows split across num_workers threads. */
+void run_chunks_threaded(chunk_function chunk,
+                         const void * const a,
+                         const void * const b,
+                         void * const c,
+                         const int dim,
+                         const int num_workers);
+
+#define DECLARE_MATRIX_KERNELS(SUFFIX, IN_T, OUT_T)                            \
+void matrix_init_##SUFFIX(IN_T * const m, const int dim);                      \
+void matrix_multiply_reference_##SUFFIX(const IN_T * const a,                  \
+                                        const IN_T * const b,                  \
+                                        OUT_T * const c,                       \
+                                        const int dim);                        \
+void matrix_multiply_rect_##SUFFIX(const void * const a,                       \
+                                   const void * const b,                       \
+                                   void * const c,                             \
+                                   const int inner,                            \
+                                   const int cols,                             \
+                                   const int row_start,                        \
+                                   const int rows,                             \
+                                   const int tile);                            \
+void matrix_multiply_chunk_##SUFFIX(const void * const a,                      \
+                                    const void * const b,                      \
+                                    void * const c,                            \
+                                    const int dim,                             \
+                                    const int row_start,                       \
+                                    const int chunk);                          \
+void matrix_multiply_threads_##SUFFIX(const IN_T * const a,                    \
+                                      const IN_T * const b,                    \
+                                      OUT_T * const c,                         \
+                                      const int dim,                           \
+                                      const int num_workers);                  \
+int  matrix_verify_##SUFFIX(const OUT_T * const m1,                            \
+                            const OUT_T * const m2,                            \
+                            const int dim);
+
+/*
+ * LINKAGE is empty for the library copies in matrix_kernels.c and
+ * "static inline" for a private copy in a single-file program, which must
+ * use a SUFFIX other than the four declared below.
+ * matrix_verify returns 0 when every element is within tolerance, else -1.
+ * The rect kernel computes rows row_start.. of c = a * b, where a has inner
+ * columns and b and c have cols. It walks tile-square blocks in ikj order
+ * so the innermost loop streams contiguous rows of b and c, which the
+ * compiler can vectorize at the full width of OUT_T; the chunk kernel uses
+ * it on square matrices with MATRIX_TILE.
+ */
+#define DEFINE_MATRIX_KERNELS(LINKAGE, SUFFIX, IN_T, OUT_T)                    \
+LINKAGE void matrix_init_##SUFFIX(IN_T * const m, const int dim)               \
+{                                                                              \
+    for (int i = 0; i < dim * dim; ++i) {                                      \
+        m[i] = (IN_T)((i * 7 + 3) % MATRIX_INIT_SPAN - MATRIX_INIT_SPAN / 2);  \
+    }                                                                          \
+}                                                                              \
+LINKAGE void matrix_multiply_reference_##SUFFIX(const IN_T * const a,          \
+                                                const IN_T * const b,          \
+                                                OUT_T * const c,               \
+                                                const int dim)                 \
+{                                                                              \
+    for (int i = 0; i < dim; ++i) {                                            \
+        for (int j = 0; j < dim; ++j) {                                        \
+            OUT_T sum = 0;                                                     \
+            for (int k = 0; k < dim; ++k) {                                    \
+                sum += (OUT_T)a[i * dim + k] * (OUT_T)b[k * dim + j];          \
+            }                                                                  \
+            c[i * dim + j] = sum;                                              \
+        }                                                                      \
+    }                                                                          \
+}                                                                              \
+LINKAGE void matrix_multiply_rect_##SUFFIX(const void * const a_in,            \
+                                           const void * const b_in,            \
+                                           void * const c_out,                 \
+                                           const int inner,                    \
+                                           const int cols,                     \
+                                           const int row_start,                \
+                                           const int rows,                     \
+                                           const int tile)                     \
+{                                                                              \
+    const IN_T * const a = (const IN_T *)a_in;                                 \
+    const IN_T * const b = (const IN_T *)b_in;                                 \
+    OUT_T * const c = (OUT_T *)c_out;                                          \
+    const int row_end = row_start + rows;                                      \
+    memset(c + (size_t)row_start * cols, 0,                                    \
+           (size_t)rows * cols * sizeof(OUT_T));                               \
+    for (int ii = row_start; ii < row_end; ii += tile) {                       \
+        const int i_end = ii + tile < row_end ? ii + tile : row_end;           \
+        for (int kk = 0; kk < inner; kk += tile) {                             \
+            const int k_end = kk + tile < inner ? kk + tile : inner;           \
+            for (int jj = 0; jj < cols; jj += tile) {                          \
+                const int j_end = jj + tile < cols ? jj + tile : cols;         \
+                for (int i = ii; i < i_end; ++i) {                             \
+                    OUT_T * const c_row = c + (size_t)i * cols;                \
+                    const IN_T * const a_row = a + (size_t)i * inner;          \
+                    for (int k = kk; k < k_end; ++k) {                         \
+                        const OUT_T a_ik = (OUT_T)a_row[k];                    \
+                        const IN_T * const b_row = b + (size_t)k * cols;       \
+                        for (int j = jj; j < j_end; ++j) {                     \
+                            c_row[j] += a_ik * (OUT_T)b_row[j];                \
+                        }                                                      \
+                    }                                                          \
+                }                                                              \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+}                                                                              \
+LINKAGE void matrix_multiply_chunk_##SUFFIX(const void * const a,              \
+                                            const void * const b,              \
+                                            void * const c,                    \
+                                            const int dim,                     \
+                                            const int row_start,               \
+                                            const int chunk)                   \
+{                                                                              \
+    matrix_multiply_rect_##SUFFIX(a, b, c, dim, dim, row_start, chunk,         \
+                                  MATRIX_TILE);                                \
+}                                                                              \
+LINKAGE int matrix_verify_##SUFFIX(const OUT_T * const m1,                     \
+                                   const OUT_T * const m2,                     \
+                                   const int dim)                              \
+{                                                                              \
+    for (int i = 0; i < dim * dim; ++i) {                                      \
+        const double expected = (double)m2[i];                                 \
+        const double scale = fabs(expected) > 1.0 ? fabs(expected) : 1.0;      \
+        if (fabs((double)m1[i] - expected) > MATRIX_TOLERANCE_##SUFFIX * scale) { \
+            return -1;                                                         \
+        }                                                                      \
+    }                                                                          \
+    return 0;                                                                  \
+}
+
+#define DEFINE_MATRIX_THREADS(SUFFIX, IN_T, OUT_T)                             \
+void matrix_multiply_threads_##SUFFIX(const IN_T * const a,                    \
+                                      const IN_T * const b,                    \
+                                      OUT_T * const c,                         \
+                                      const int dim,                           \
+                                      const int num_workers)                   \
+{                                                                              \
+    run_chunks_threaded(matrix_multiply_chunk_##SUFFIX,                        \
+                        a, b, c, dim, num_workers);                            \
+}
+
+DECLARE_MATRIX_KERNELS(f64, double,  double)
+DECLARE_MATRIX_KERNELS(f32, float,   float)
+DECLARE_MATRIX_KERNELS(i32, int32_t, int32_t)
+DECLARE_MATRIX_KERNELS(i8,  int8_t,  int32_t)
+
+#endif
@@ -4,30 +4,52 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
 #include <math.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "matrix_buffer.h"
+#include "matrix_kernels.h"
 #include "matrix_mult.h"
+#include "matrix_tune.h"
 
 #define USEC_IN_SEC 1000000L   
-#define EPS         1e-9
 
-static void *xmalloc(size_t nbytes)
-{
-    void *p = malloc(nbytes);
-    if (p == NULL) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
-    }
-    return p;
-}
+/*
+ * Pipeline tasks are numbered in the order workers take them: first one
+ * per panel of b, then one per panel of a, each of which also multiplies
+ * the matching panel of c once all of b is in. Every worker first-touches
+ * the rows it produces, and the product of the early panels overlaps the
+ * loading of the later ones.
+ */
+typedef struct {
+    const MatrixSource *a_source;
+    const MatrixSource *b_source;
+    double *a;
+    double *b;
+    double *c;
+    int dim;
+    int panels;
+    int next_task;
+    int b_panels_done;
+    int panels_done;
+    bool computing;
+    pthread_mutex_t lock;
+    pthread_cond_t b_ready;
+    PipelineTimes *times;
+} Pipeline;
+
 void init_matrix(double *matrix, int dim)
 {
     double val = 1.0;
@@ -35,6 +57,81 @@ void init_matrix(double *matrix, int dim)
         matrix[i] = val++;
     }
 }
+void matrix_source_open(MatrixSource *source, const char *path, int dim)
+{
+    source->path = path;
+    source->fd = -1;
+    if (path == NULL) {
+        return;
+    }
+    struct stat sb;
+    source->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (source->fd < 0 || fstat(source->fd, &sb) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t)sb.st_size < (size_t)dim * dim * sizeof(double)) {
+        fprintf(stderr, "%s: expected %d x %d doubles.\n", path, dim, dim);
+        exit(EXIT_FAILURE);
+    }
+}
+void matrix_source_close(MatrixSource *source)
+{
+    if (source->fd >= 0) {
+        close(source->fd);
+    }
+    source->fd = -1;
+}
+/* Fills rows [row_start, row_start + rows) with the same values init_matrix would. */
+void produce_rows(const MatrixSource *source,
+                  double *matrix,
+                  int dim,
+                  int row_start,
+                  int rows)
+{
+    const size_t first = (size_t)row_start * dim;
+    const size_t count = (size_t)rows * dim;
+    if (source->fd < 0) {
+        for (size_t i = first; i < first + count; ++i) {
+            matrix[i] = (double)(i + 1);
+        }
+        return;
+    }
+    char *dest = (char *)(matrix + first);
+    size_t left = count * sizeof(double);
+    off_t offset = (off_t)(first * sizeof(double));
+    while (left > 0) {
+        ssize_t n = pread(source->fd, dest, left, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            perror(source->path);
+            exit(EXIT_FAILURE);
+        }
+        dest += n;
+        left -= n;
+        offset += n;
+    }
+}
+static void produce_chunk(const void * const source,
+                          const void * const unused,
+                          void * const matrix,
+                          const int dim,
+                          const int row_start,
+                          const int chunk)
+{
+    (void)unused;
+    produce_rows(source, matrix, dim, row_start, chunk);
+}
+/* Each worker first-touches the rows it will later multiply. */
+void load_matrix(const MatrixSource *source,
+                 double *matrix,
+                 int dim,
+                 int num_workers)
+{
+    run_chunks_threaded(produce_chunk, source, NULL, matrix, dim, num_workers);
+}
 void print_matrix(const double *matrix, int dim)
 {
     for (int i = 0; i < dim; ++i) {
@@ -46,12 +143,7 @@ void print_matrix(const double *matrix, int dim)
 }
 int verify(const double *m1, const double *m2, int dim)
 {
-    for (int i = 0; i < dim * dim; ++i) {
-        if (fabs(m1[i] - m2[i]) > EPS) {
-            return FAILURE;
-        }
-    }
-    return SUCCESS;
+    return matrix_verify_f64(m1, m2, dim) == 0 ? SUCCESS : FAILURE;
 }
 void print_verification(const double *m1,
                         const double *m2,
@@ -85,6 +177,40 @@ void print_elapsed_time(struct timeval *start,
            sec,  (sec  == 1 ? "" : "s"),
            usec, (usec == 1 ? "" : "s"));
 }
+/*
+ * Opens a counter of user-space dTLB load misses for this process and any
+ * children or threads it creates afterwards. Returns -1 where perf events
+ * are not permitted, in which case no count is reported.
+ */
+static int tlb_counter_open(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HW_CACHE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CACHE_DTLB
+                          | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                          | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled       = 1;
+    attr.inherit        = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+static void print_tlb_misses(int fd, const char *name)
+{
+    uint64_t misses;
+    if (fd < 0) {
+        printf("dTLB load misses for %s: unavailable.\n", name);
+        return;
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof(misses)) == sizeof(misses)) {
+        printf("dTLB load misses for %s: %llu.\n",
+               name, (unsigned long long)misses);
+    }
+    close(fd);
+}
 void multiply_chunk(const double * const a,
                     const double * const b,
                     double * const c,
@@ -103,6 +229,7 @@ void multiply_chunk(const double * const a,
         }
     }
 }
+/* Same kernel as the parallel drivers, so they differ only in parallelism. */
 void multiply_serial(const double * const a,
                      const double * const b,
                      double * const c,
@@ -110,7 +237,7 @@ void multiply_serial(const double * const a,
                      const int num_workers)
 {
     (void)num_workers;
-    multiply_chunk(a, b, c, dim, 0, dim);
+    matrix_multiply_chunk_f64(a, b, c, dim, 0, dim);
 }
 static pid_t fork_checked(void)
 {
@@ -121,53 +248,38 @@ static pid_t fork_checked(void)
     }
     return pid;
 }
-static void *mmap_checked(size_t length)
-{
-    void *addr = mmap(NULL, length,
-                      PROT_READ | PROT_WRITE,
-                      MAP_ANONYMOUS | MAP_SHARED,
-                      -1, 0);
-    if (addr == MAP_FAILED) {
-        perror("mmap");
-        exit(EXIT_FAILURE);
-    }
-    return addr;
-}
-static void munmap_checked(void *addr, size_t length)
-{
-    if (munmap(addr, length) < 0) {
-        perror("munmap");
-        exit(EXIT_FAILURE);
-    }
-}
-void multiply_parallel_processes(const double * const a,
-                                 const double * const b,
-                                 double * const c,
-                                 const int dim,
-                                 const int num_workers)
+/* Runs chunk_fn over dim rows split across num_workers processes. */
+void run_chunks_processes(chunk_function chunk_fn,
+                          const double * const a,
+                          const double * const b,
+                          double * const c,
+                          const int dim,
+                          const int num_workers)
 {
     const size_t bytes  = (size_t)dim * dim * sizeof(double);
-    double *shared_prod = (double *)mmap_checked(bytes);
+    double *shared_prod = (double *)buffer_alloc(bytes, true, NULL);
     memset(shared_prod, 0, bytes);
     const int chunk = dim / num_workers;
     int row_start   = 0;
     for (int w = 0; w < num_workers - 1; ++w) {
         if (fork_checked() == 0) {
-            multiply_chunk(a, b, shared_prod, dim, row_start, chunk);
+            chunk_fn(a, b, shared_prod, dim, row_start, chunk);
             _Exit(0);
         }
         row_start += chunk;
     }
-    multiply_chunk(a, b, shared_prod, dim, row_start, dim - row_start);
+    chunk_fn(a, b, shared_prod, dim, row_start, dim - row_start);
     while (wait(NULL) > 0) { }
     memcpy(c, shared_prod, bytes);
-    munmap_checked(shared_prod, bytes);
+    buffer_free(shared_prod, bytes);
 }
-static void *task(void *arg)
+void multiply_parallel_processes(const double * const a,
+                                 const double * const b,
+                                 double * const c,
+                                 const int dim,
+                                 const int num_workers)
 {
-    Args *p = (Args *)arg;
-    multiply_chunk(p->a, p->b, p->c, p->dim, p->row_start, p->chunk);
-    return NULL;
+    run_chunks_processes(matrix_multiply_chunk_f64, a, b, c, dim, num_workers);
 }
 void multiply_parallel_threads(const double * const a,
                                const double * const b,
@@ -175,34 +287,17 @@ void multiply_parallel_threads(const double * const a,
                                const int dim,
                                const int num_workers)
 {
-    pthread_t tids[NUM_WORKERS];
-    Args *arg_set = (Args *)xmalloc(sizeof(Args) * num_workers);
-    const int chunk = dim / num_workers;
-    int row   = 0;
-    Args template = { .a = a, .b = b, .c = c, .dim = dim,
-                      .row_start = 0, .chunk = chunk };
-    for (int i = 0; i < num_workers; ++i) {
-        arg_set[i]          = template;
-        arg_set[i].row_start = row;
-        arg_set[i].chunk = (i == num_workers - 1)
-                           ? (dim - row) : chunk;
-        row += chunk;
-    }
-    const int num_threads = num_workers - 1;
-    for (int id = 0; id < num_threads; ++id) {
-        if (pthread_create(&tids[id], NULL, task, &arg_set[id]) != 0) {
-            perror("pthread_create");
-            exit(EXIT_FAILURE);
-        }
-    }
-    task(&arg_set[num_workers - 1]);
-    for (int id = 0; id < num_threads; ++id) {
-        if (pthread_join(tids[id], NULL) != 0) {
-            perror("pthread_join");
-            exit(EXIT_FAILURE);
-        }
-    }
-    free(arg_set);
+    matrix_multiply_threads_f64(a, b, c, dim, num_workers);
+}
+/* Runs the kernel, driver and worker count the tuning cache has for dim. */
+void multiply_tuned(const double * const a,
+                    const double * const b,
+                    double * const c,
+                    const int dim,
+                    const int num_workers)
+{
+    (void)num_workers;
+    tune_run(tune_config(dim), a, b, c, dim);
 }
 void run_and_time(multiply_function    multiply_fn,
                   const double * const a,
@@ -215,14 +310,113 @@ void run_and_time(multiply_function    multiply_fn,
                   const bool do_verify)
 {
     struct timeval start, end;
+    const int workers = num_workers == TUNED_WORKERS
+                        ? tune_config(dim)->workers : num_workers;
     printf("Algorithm: %s with %d worker%s.\n",
-           name, num_workers, (num_workers == 1 ? "" : "s"));
+           name, workers, (workers == 1 ? "" : "s"));
+    int tlb_fd = tlb_counter_open();
+    if (tlb_fd >= 0) {
+        ioctl(tlb_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(tlb_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
     gettimeofday(&start, NULL);
-    multiply_fn(a, b, c, dim, num_workers);
+    multiply_fn(a, b, c, dim, workers);
     gettimeofday(&end, NULL);
     print_elapsed_time(&start, &end, name);
+    print_tlb_misses(tlb_fd, name);
     if (do_verify) {
         print_verification(c, gold, dim, name);
     }
 }
 
+static int panel_rows(const Pipeline *p, int panel)
+{
+    const int row_start = panel * PANEL_ROWS;
+    return row_start + PANEL_ROWS < p->dim ? PANEL_ROWS : p->dim - row_start;
+}
+/* Produces one panel of rows; the last one marks the inputs ready. */
+static void produce_panel(Pipeline *p, bool of_b, int panel)
+{
+    produce_rows(of_b ? p->b_source : p->a_source, of_b ? p->b : p->a,
+                 p->dim, panel * PANEL_ROWS, panel_rows(p, panel));
+    pthread_mutex_lock(&p->lock);
+    if (++p->panels_done == 2 * p->panels) {
+        gettimeofday(&p->times->inputs_ready, NULL);
+    }
+    if (of_b && ++p->b_panels_done == p->panels) {
+        pthread_cond_broadcast(&p->b_ready);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+static void *pipeline_worker(void *arg)
+{
+    Pipeline *p = (Pipeline *)arg;
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        const int task = p->next_task++;
+        pthread_mutex_unlock(&p->lock);
+        if (task >= 2 * p->panels) {
+            return NULL;
+        }
+        if (task < p->panels) {
+            produce_panel(p, true, task);
+            continue;
+        }
+        const int panel = task - p->panels;
+        const int rows = panel_rows(p, panel);
+        produce_panel(p, false, panel);
+        pthread_mutex_lock(&p->lock);
+        while (p->b_panels_done < p->panels) {
+            pthread_cond_wait(&p->b_ready, &p->lock);
+        }
+        if (!p->computing) {
+            p->computing = true;
+            gettimeofday(&p->times->compute_start, NULL);
+        }
+        pthread_mutex_unlock(&p->lock);
+        matrix_multiply_chunk_f64(p->a, p->b, p->c, p->dim, panel * PANEL_ROWS, rows);
+    }
+}
+/*
+ * Produces a and b from their sources and multiplies them into c on
+ * num_workers threads, overlapping setup with compute panel by panel.
+ */
+void multiply_pipelined(const MatrixSource *a_source,
+                        const MatrixSource *b_source,
+                        double *a,
+                        double *b,
+                        double *c,
+                        int dim,
+                        int num_workers,
+                        PipelineTimes *times)
+{
+    Pipeline p = { .a_source = a_source, .b_source = b_source,
+                   .a = a, .b = b, .c = c, .dim = dim,
+                   .panels = (dim + PANEL_ROWS - 1) / PANEL_ROWS,
+                   .times = times };
+    pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * num_workers);
+    if (tids == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.b_ready, NULL);
+    gettimeofday(&times->start, NULL);
+    for (int id = 0; id < num_workers - 1; ++id) {
+        if (pthread_create(&tids[id], NULL, pipeline_worker, &p) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pipeline_worker(&p);
+    for (int id = 0; id < num_workers - 1; ++id) {
+        if (pthread_join(tids[id], NULL) != 0) {
+            perror("pthread_join");
+            exit(EXIT_FAILURE);
+        }
+    }
+    gettimeofday(&times->end, NULL);
+    pthread_cond_destroy(&p.b_ready);
+    pthread_mutex_destroy(&p.lock);
+    free(tids);
+}
@@ -8,31 +8,67 @@
 #include <stdbool.h>
 #include <sys/time.h>
 
+#include "matrix_kernels.h"
+
 #define DIM          1024
-#define NUM_WORKERS  4
+#define TUNED_WORKERS 0
 #define SUCCESS      0
 #define FAILURE     -1
+#define PANEL_ROWS   64
+
+/*
+ * Where an input matrix comes from: a file of dim * dim doubles in row-major
+ * host byte order when path is set, else the values init_matrix generates.
+ */
+typedef struct MatrixSource {
+    const char *path;
+    int fd;
+} MatrixSource;
+
+typedef struct PipelineTimes {
+    struct timeval start;
+    struct timeval inputs_ready;    /* the last panel of a or b produced */
+    struct timeval compute_start;
+    struct timeval end;
+} PipelineTimes;
 
 typedef void (*multiply_function)(const double* const a,
                                   const double* const b,
                                   double* const c,
                                   const int dim,
                                   const int num_workers);
-typedef struct {
-    const double* a;
-    const double* b;
-    double* c;
-    int dim;
-    int row_start;
-    int chunk;
-} Args;
 void init_matrix(double *matrix, int dim);
+void matrix_source_open(MatrixSource *source, const char *path, int dim);
+void matrix_source_close(MatrixSource *source);
+void produce_rows(const MatrixSource *source,
+                  double *matrix,
+                  int dim,
+                  int row_start,
+                  int rows);
+void load_matrix(const MatrixSource *source,
+                 double *matrix,
+                 int dim,
+                 int num_workers);
+void multiply_pipelined(const MatrixSource *a_source,
+                        const MatrixSource *b_source,
+                        double *a,
+                        double *b,
+                        double *c,
+                        int dim,
+                        int num_workers,
+                        PipelineTimes *times);
 void multiply_chunk(const double * const a,
                     const double * const b,
                     double * const c,
                     const int dim,
                     const int row_start,
                     const int chunk);
+void run_chunks_processes(chunk_function chunk_fn,
+                          const double * const a,
+                          const double * const b,
+                          double * const c,
+                          const int dim,
+                          const int num_workers);
 void multiply_serial(const double * const a,
                      const double * const b,
                      double * const c,
@@ -48,6 +84,11 @@ void multiply_parallel_threads(const double * const a,
                                double * const c,
                                const int dim,
                                const int num_workers);
+void multiply_tuned(const double * const a,
+                    const double * const b,
+                    double * const c,
+                    const int dim,
+                    const int num_workers);
 void print_elapsed_time(struct timeval *start,
                         struct timeval *end,
                         const char * const name);
@@ -56,6 +97,7 @@ void print_verification(const double * const m1,
                         const double * const m2,
                         const int dim,
                         const char * const name);
+/* num_workers of TUNED_WORKERS takes the count from the tuning cache. */
 void run_and_time(multiply_function multiply_matrices,
                   const double * const a,
                   const double * const b,
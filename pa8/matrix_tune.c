@@ -0,0 +1,361 @@
+/*
+ * matrix_tune.c
+ * The cache is a text file with one line per CPU model and size class:
+ * model, class, kernel, tile, driver, workers and the measured time in
+ * microseconds, separated by tabs. autotune rewrites its line through a
+ * temporary file so a concurrent reader never sees a partial cache.
+ * Author: Lawrence Kim - kimevm@bc.edu, Nicholas Hernandez - hernantx@bc.edu
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "matrix_buffer.h"
+#include "matrix_kernels.h"
+#include "matrix_mult.h"
+#include "matrix_tune.h"
+
+#define CPU_MODEL_LEN  256
+#define CACHE_LINE_LEN 512
+#define MAX_CLASSES    32
+
+typedef struct {
+    const char *name;
+    int tile;
+    chunk_function chunk;
+    bool accumulates;   /* adds into c rather than overwriting its rows */
+} TuneKernel;
+
+static void naive_chunk(const void * const a,
+                        const void * const b,
+                        void * const c,
+                        const int dim,
+                        const int row_start,
+                        const int chunk)
+{
+    multiply_chunk(a, b, c, dim, row_start, chunk);
+}
+
+#define DEFINE_TILED_CHUNK(TILE)                                          \
+static void tiled_chunk_##TILE(const void * const a,                      \
+                               const void * const b,                      \
+                               void * const c,                            \
+                               const int dim,                             \
+                               const int row_start,                       \
+                               const int chunk)                           \
+{                                                                         \
+    matrix_multiply_rect_f64(a, b, c, dim, dim, row_start, chunk, TILE);  \
+}
+
+DEFINE_TILED_CHUNK(32)
+DEFINE_TILED_CHUNK(64)
+DEFINE_TILED_CHUNK(128)
+
+#define DEFAULT_KERNEL 2
+
+static const TuneKernel kernels[] = {
+    {"naive", 0,   naive_chunk,     true},
+    {"tiled", 32,  tiled_chunk_32,  false},
+    {"tiled", 64,  tiled_chunk_64,  false},
+    {"tiled", 128, tiled_chunk_128, false}
+};
+static const int num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+static const char * const driver_names[] = {"threads", "processes"};
+
+static TuneConfig configs[MAX_CLASSES];
+static bool configs_loaded[MAX_CLASSES];
+
+int tune_size_class(int dim)
+{
+    int size_class = TUNE_MIN_CLASS;
+    while (size_class < dim && size_class < TUNE_MAX_CLASS) {
+        size_class *= 2;
+    }
+    return size_class;
+}
+static int class_index(int size_class)
+{
+    int index = 0;
+    while ((TUNE_MIN_CLASS << index) < size_class) {
+        ++index;
+    }
+    return index;
+}
+static const char *cache_path(void)
+{
+    const char *path = getenv(TUNE_CACHE_ENV);
+    return path != NULL && path[0] != '\0' ? path : TUNE_CACHE_FILE;
+}
+/* The model name from /proc/cpuinfo and the online CPU count, without tabs. */
+static void cpu_model(char *model, size_t size)
+{
+    char line[CACHE_LINE_LEN];
+    const char *name = "unknown";
+    FILE *file = fopen("/proc/cpuinfo", "r");
+    while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "model name", 10) == 0 && strchr(line, ':') != NULL) {
+            name = strchr(line, ':') + 1;
+            name += strspn(name, " \t");
+            line[strcspn(line, "\n")] = '\0';
+            break;
+        }
+    }
+    snprintf(model, size, "%s (%d cpus)", name, matrix_default_workers());
+    if (file != NULL) {
+        fclose(file);
+    }
+    for (char *p = model; *p != '\0'; ++p) {
+        if (*p == '\t') {
+            *p = ' ';
+        }
+    }
+}
+static int find_kernel(const char *name, int tile)
+{
+    for (int k = 0; k < num_kernels; ++k) {
+        if (strcmp(kernels[k].name, name) == 0 && kernels[k].tile == tile) {
+            return k;
+        }
+    }
+    return -1;
+}
+/* Parses one cache line; returns true if it is for model and size_class. */
+static bool parse_cache_line(char *line,
+                             const char *model,
+                             int size_class,
+                             TuneConfig *config)
+{
+    char *save = NULL;
+    const char *fields[6];
+    line[strcspn(line, "\n")] = '\0';
+    for (int f = 0; f < 6; ++f) {
+        fields[f] = strtok_r(f == 0 ? line : NULL, "\t", &save);
+        if (fields[f] == NULL) {
+            return false;
+        }
+    }
+    if (strcmp(fields[0], model) != 0 || atoi(fields[1]) != size_class) {
+        return false;
+    }
+    const int kernel = find_kernel(fields[2], atoi(fields[3]));
+    const int workers = atoi(fields[5]);
+    int driver = -1;
+    for (int d = 0; d < 2; ++d) {
+        if (strcmp(fields[4], driver_names[d]) == 0) {
+            driver = d;
+        }
+    }
+    if (kernel < 0 || driver < 0 || workers < 1 || workers > MATRIX_MAX_WORKERS) {
+        return false;
+    }
+    config->kernel = kernel;
+    config->driver = (TuneDriver)driver;
+    config->workers = workers;
+    config->from_cache = true;
+    return true;
+}
+const TuneConfig *tune_config(int dim)
+{
+    const int size_class = tune_size_class(dim);
+    const int index = class_index(size_class);
+    TuneConfig *config = &configs[index];
+    if (configs_loaded[index]) {
+        return config;
+    }
+    configs_loaded[index] = true;
+    *config = (TuneConfig){ .kernel = DEFAULT_KERNEL, .driver = TUNE_THREADS,
+                            .workers = matrix_default_workers(),
+                            .from_cache = false };
+    char model[CPU_MODEL_LEN];
+    char line[CACHE_LINE_LEN];
+    cpu_model(model, sizeof(model));
+    FILE *file = fopen(cache_path(), "r");
+    if (file == NULL) {
+        return config;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        parse_cache_line(line, model, size_class, config);
+    }
+    fclose(file);
+    return config;
+}
+void tune_run(const TuneConfig *config,
+              const double *a,
+              const double *b,
+              double *c,
+              int dim)
+{
+    const TuneKernel *kernel = &kernels[config->kernel];
+    if (config->driver == TUNE_PROCESSES) {
+        run_chunks_processes(kernel->chunk, a, b, c, dim, config->workers);
+        return;
+    }
+    if (kernel->accumulates) {
+        memset(c, 0, (size_t)dim * dim * sizeof(double));
+    }
+    run_chunks_threaded(kernel->chunk, a, b, c, dim, config->workers);
+}
+void tune_describe(const TuneConfig *config, char *buffer, size_t size)
+{
+    const TuneKernel *kernel = &kernels[config->kernel];
+    if (kernel->tile > 0) {
+        snprintf(buffer, size, "%s %d, %s, %d worker%s", kernel->name,
+                 kernel->tile, driver_names[config->driver], config->workers,
+                 config->workers == 1 ? "" : "s");
+    } else {
+        snprintf(buffer, size, "%s, %s, %d worker%s", kernel->name,
+                 driver_names[config->driver], config->workers,
+                 config->workers == 1 ? "" : "s");
+    }
+}
+/* Replaces the line for model and size_class, keeping every other line. */
+static int store_config(const char *model,
+                        int size_class,
+                        const TuneConfig *config,
+                        long usec)
+{
+    const char *path = cache_path();
+    const size_t length = strlen(path) + sizeof(".tmp");
+    char *temp_path = malloc(length);
+    char line[CACHE_LINE_LEN];
+    char copy[CACHE_LINE_LEN];
+    TuneConfig ignored;
+    if (temp_path == NULL) {
+        return -1;
+    }
+    snprintf(temp_path, length, "%s.tmp", path);
+    FILE *out = fopen(temp_path, "w");
+    if (out == NULL) {
+        perror(temp_path);
+        free(temp_path);
+        return -1;
+    }
+    FILE *in = fopen(path, "r");
+    while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+        memcpy(copy, line, sizeof(line));
+        if (!parse_cache_line(copy, model, size_class, &ignored)) {
+            fputs(line, out);
+        }
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    const TuneKernel *kernel = &kernels[config->kernel];
+    fprintf(out, "%s\t%d\t%s\t%d\t%s\t%d\t%ld\n", model, size_class,
+            kernel->name, kernel->tile, driver_names[config->driver],
+            config->workers, usec);
+    int status = 0;
+    if (fclose(out) != 0 || rename(temp_path, path) != 0) {
+        perror(path);
+        remove(temp_path);
+        status = -1;
+    }
+    free(temp_path);
+    return status;
+}
+static int compare_usec(const void *x, const void *y)
+{
+    const long a = *(const long *)x;
+    const long b = *(const long *)y;
+    return (a > b) - (a < b);
+}
+/*
+ * Runs config at least TUNE_MIN_REPEATS times and for at least
+ * TUNE_MIN_USEC, and returns the median run.
+ */
+static long time_config(const TuneConfig *config,
+                        const double *a,
+                        const double *b,
+                        double *c,
+                        int dim)
+{
+    long runs[TUNE_MAX_REPEATS];
+    long total = 0;
+    int count = 0;
+    while (count < TUNE_MAX_REPEATS
+           && (count < TUNE_MIN_REPEATS || total < TUNE_MIN_USEC)) {
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        tune_run(config, a, b, c, dim);
+        gettimeofday(&end, NULL);
+        runs[count] = (end.tv_sec - start.tv_sec) * 1000000L
+                      + (end.tv_usec - start.tv_usec);
+        total += runs[count++];
+    }
+    qsort(runs, count, sizeof(runs[0]), compare_usec);
+    return runs[count / 2];
+}
+/*
+ * Fills workers with the powers of two up to two per CPU, plus one and two
+ * per CPU themselves, ascending; returns how many there are.
+ */
+static int worker_candidates(int *workers)
+{
+    const int cpus = matrix_default_workers();
+    const int max_workers = 2 * cpus < MATRIX_MAX_WORKERS ? 2 * cpus : MATRIX_MAX_WORKERS;
+    int count = 0;
+    for (int w = 1; w <= max_workers; ++w) {
+        if ((w & (w - 1)) == 0 || w == cpus || w == max_workers) {
+            workers[count++] = w;
+        }
+    }
+    return count;
+}
+int autotune(int dim)
+{
+    const int size_class = tune_size_class(dim);
+    int workers[MATRIX_MAX_WORKERS];
+    const int num_workers = worker_candidates(workers);
+    const size_t bytes = (size_t)size_class * size_class * sizeof(double);
+    char model[CPU_MODEL_LEN];
+    char description[CACHE_LINE_LEN];
+    cpu_model(model, sizeof(model));
+    printf("Tuning size class %d on %s with %d x %d matrices.\n",
+           size_class, model, size_class, size_class);
+
+    double *a = buffer_alloc(bytes, false, NULL);
+    double *b = buffer_alloc(bytes, false, NULL);
+    double *c = buffer_alloc(bytes, false, NULL);
+    double *gold = buffer_alloc(bytes, false, NULL);
+    matrix_init_f64(a, size_class);
+    matrix_init_f64(b, size_class);
+    matrix_multiply_reference_f64(a, b, gold, size_class);
+
+    TuneConfig best = { .kernel = DEFAULT_KERNEL, .driver = TUNE_THREADS,
+                        .workers = 1, .from_cache = true };
+    long best_usec = -1;
+    for (int k = 0; k < num_kernels; ++k) {
+        for (int d = 0; d < 2; ++d) {
+            for (int w = 0; w < num_workers; ++w) {
+                TuneConfig candidate = { .kernel = k, .driver = (TuneDriver)d,
+                                         .workers = workers[w], .from_cache = true };
+                const long usec = time_config(&candidate, a, b, c, size_class);
+                tune_describe(&candidate, description, sizeof(description));
+                if (verify(c, gold, size_class) != SUCCESS) {
+                    printf("  %-36s failed verification\n", description);
+                    continue;
+                }
+                printf("  %-36s %10ld microseconds (median)\n", description, usec);
+                if (best_usec < 0 || usec < best_usec) {
+                    best = candidate;
+                    best_usec = usec;
+                }
+            }
+        }
+    }
+    buffer_free(gold, bytes);
+    buffer_free(c, bytes);
+    buffer_free(b, bytes);
+    buffer_free(a, bytes);
+    if (best_usec < 0) {
+        fprintf(stderr, "No configuration passed verification.\n");
+        return -1;
+    }
+    tune_describe(&best, description, sizeof(description));
+    printf("Best for size class %d: %s.\n", size_class, description);
+    configs[class_index(size_class)] = best;
+    configs_loaded[class_index(size_class)] = true;
+    return store_config(model, size_class, &best, best_usec);
+}
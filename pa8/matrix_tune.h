@@ -0,0 +1,56 @@
+/*
+ * matrix_tune.h
+ * Per-machine choice of kernel, tile size, driver and worker count for the
+ * double-precision multiply, measured by autotune and kept in a cache file
+ * keyed by CPU model and size class.
+ * Author: Lawrence Kim - kimevm@bc.edu, Nicholas Hernandez - hernantx@bc.edu
+ */
+#ifndef MATRIX_TUNE_H
+#define MATRIX_TUNE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TUNE_CACHE_FILE "matrix_tune.cache"
+#define TUNE_CACHE_ENV  "MATRIX_TUNE_CACHE"
+#define TUNE_MIN_CLASS  64
+#define TUNE_MAX_CLASS  512
+#define TUNE_MIN_REPEATS 3
+#define TUNE_MAX_REPEATS 31
+#define TUNE_MIN_USEC   200000L
+
+typedef enum {
+    TUNE_THREADS,
+    TUNE_PROCESSES
+} TuneDriver;
+
+typedef struct {
+    int kernel;         /* index into the kernel table in matrix_tune.c */
+    TuneDriver driver;
+    int workers;
+    bool from_cache;
+} TuneConfig;
+
+/*
+ * Sizes up to the next power of two (at least TUNE_MIN_CLASS) share a class;
+ * sizes above TUNE_MAX_CLASS all share that class.
+ */
+int tune_size_class(int dim);
+/*
+ * Returns the cached configuration for dim's size class on this CPU, or
+ * the tiled kernel on one thread per CPU when there is none.
+ */
+const TuneConfig *tune_config(int dim);
+void tune_run(const TuneConfig *config,
+              const double *a,
+              const double *b,
+              double *c,
+              int dim);
+void tune_describe(const TuneConfig *config, char *buffer, size_t size);
+/*
+ * Times every candidate on a problem the size of dim's size class, prints
+ * the median of its runs, and caches the fastest. Returns 0 on success.
+ */
+int autotune(int dim);
+
+#endif
@@ -7,7 +7,7 @@ EXPECTED=expected_${APP}_${HOST}.txt
 OUTPUT=output.txt
 
 echo Building ...
-gcc -Wall -Werror -std=c99 ${APP}.c -o ${APP}
+gcc -Wall -Werror -std=c99 -O2 -pthread ${APP}.c -o ${APP} -lm
 echo Building complete.
 
 echo Running ...
@@ -4,72 +4,1550 @@
  * indentation corresponding to depth in the filesystem hierarchy.
  * Author: Lawrence Kim - kimevm@bc.edu, Nicholas Hernandez - hernantx@bc.edu
  */
+#define _GNU_SOURCE
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INDENT_WIDTH 4
+#define MAX_WORKERS 256
+#define INITIAL_CAPACITY 16
+#define DENTS_BUFFER_SIZE (64 * 1024)
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define INDENT_CACHE_SIZE 256
+#define OPEN_DIR_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#define SNAPSHOT_MAGIC "TREESNP1"
+#define NO_DIR UINT32_MAX
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define WATCH_SETTLE_MS 100
+#define INOTIFY_BUFFER_SIZE (64 * 1024)
+#define LARGEST_ENTRIES 10
+#define STATX_FLAGS (AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC)
+#define STATX_FIELDS (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_BLOCKS)
+
+/* Record layout returned by getdents64(2). */
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} LinuxDirent64;
+
+typedef enum {
+    FORMAT_TREE,
+    FORMAT_NUL,
+    FORMAT_JSON
+} OutputFormat;
+
+typedef struct {
+    char * data;
+    size_t len;
+    size_t cap;
+} TextBuffer;
 
 int show_hidden = 0;
+int disk_usage = 0;
+int num_workers = 1;
+OutputFormat output_format = FORMAT_TREE;
+char indent_cache[INDENT_CACHE_SIZE];
+TextBuffer output;
 
 int is_pwd_or_parent(const char * name) {
     return (strcmp(name, ".") == 0 || strcmp(name, "..") == 0);
 }
 
-void indent(int level) {
-    for (int i = 0; i < level; i++) {
-        for (int j = 0; j < 4; j++) {
-            putchar(' ');
+void * xrealloc(void * ptr, size_t size) {
+    void * p = realloc(ptr, size);
+    if (p == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/*
+ * Output.
+ * Lines are formatted into TextBuffers and stdout is written with write(2)
+ * a megabyte at a time. Indentation is copied from a prefilled run of
+ * spaces instead of being emitted one character at a time.
+ */
+void text_reserve(TextBuffer * text, size_t extra) {
+    if (text->len + extra > text->cap) {
+        size_t cap = text->cap ? text->cap : INITIAL_CAPACITY;
+        while (cap < text->len + extra) {
+            cap *= 2;
+        }
+        text->data = xrealloc(text->data, cap);
+        text->cap = cap;
+    }
+}
+
+void text_append(TextBuffer * text, const char * s, size_t len) {
+    text_reserve(text, len);
+    memcpy(text->data + text->len, s, len);
+    text->len += len;
+}
+
+void text_putc(TextBuffer * text, char c) {
+    text_reserve(text, 1);
+    text->data[text->len++] = c;
+}
+
+void text_indent(TextBuffer * text, int level) {
+    size_t width = (size_t)level * INDENT_WIDTH;
+    while (width > 0) {
+        size_t chunk = width < INDENT_CACHE_SIZE ? width : INDENT_CACHE_SIZE;
+        text_append(text, indent_cache, chunk);
+        width -= chunk;
+    }
+}
+
+/* Appends "dir/name", leaving out the '/' when dir already ends with one. */
+void text_path(TextBuffer * text, const char * dir_name, const char * name) {
+    size_t dir_len = strlen(dir_name);
+    text_append(text, dir_name, dir_len);
+    if (dir_len == 0 || dir_name[dir_len - 1] != '/') {
+        text_putc(text, '/');
+    }
+    text_append(text, name, strlen(name));
+}
+
+/* Escapes quotes, backslashes and control characters; other bytes pass through. */
+void text_json_escape(TextBuffer * text, const char * s) {
+    static const char hex[] = "0123456789abcdef";
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            text_putc(text, '\\');
+            text_putc(text, c);
+        } else if (c < 0x20) {
+            char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+            text_append(text, escape, sizeof(escape));
+        } else {
+            text_putc(text, c);
+        }
+    }
+}
+
+const char * type_name(unsigned char type) {
+    switch (type) {
+    case DT_DIR:
+        return "directory";
+    case DT_REG:
+        return "file";
+    case DT_LNK:
+        return "symlink";
+    case DT_UNKNOWN:
+        return "unknown";
+    default:
+        return "other";
+    }
+}
+
+/* One NDJSON object; change is "added" or "removed" when reporting a diff. */
+void format_json(TextBuffer * text, const char * change, const char * dir_name, const char * name, unsigned char type, int level) {
+    char depth[32];
+    text_putc(text, '{');
+    if (change != NULL) {
+        text_append(text, "\"change\":\"", 10);
+        text_append(text, change, strlen(change));
+        text_append(text, "\",", 2);
+    }
+    text_append(text, "\"path\":\"", 8);
+    text_json_escape(text, dir_name);
+    if (dir_name[0] == '\0' || dir_name[strlen(dir_name) - 1] != '/') {
+        text_putc(text, '/');
+    }
+    text_json_escape(text, name);
+    text_append(text, "\",\"type\":\"", 10);
+    text_append(text, type_name(type), strlen(type_name(type)));
+    text_append(text, depth, snprintf(depth, sizeof(depth), "\",\"depth\":%d}\n", level));
+}
+
+void format_entry(TextBuffer * text, const char * dir_name, const char * name, unsigned char type, int level) {
+    switch (output_format) {
+    case FORMAT_TREE:
+        text_indent(text, level);
+        text_append(text, name, strlen(name));
+        if (type == DT_DIR) {
+            text_append(text, ":\n", 2);
+        } else {
+            text_putc(text, '\n');
+        }
+        break;
+    case FORMAT_NUL:
+        text_path(text, dir_name, name);
+        text_putc(text, '\0');
+        break;
+    case FORMAT_JSON:
+        format_json(text, NULL, dir_name, name, type, level);
+        break;
+    }
+}
+
+/* Reports an entry that was added ('+') or removed ('-') since the last walk. */
+void format_change(TextBuffer * text, char sign, const char * dir_name, const char * name, unsigned char type, int level) {
+    if (output_format == FORMAT_JSON) {
+        format_json(text, sign == '+' ? "added" : "removed", dir_name, name, type, level);
+        return;
+    }
+    text_putc(text, sign);
+    text_putc(text, ' ');
+    text_path(text, dir_name, name);
+    text_putc(text, output_format == FORMAT_NUL ? '\0' : '\n');
+}
+
+void write_all(int fd, const char * data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+void output_flush(void) {
+    write_all(STDOUT_FILENO, output.data, output.len);
+    output.len = 0;
+}
+
+void output_maybe_flush(void) {
+    if (output.len >= OUTPUT_BUFFER_SIZE) {
+        output_flush();
+    }
+}
+
+void output_write(const char * data, size_t len) {
+    if (len >= OUTPUT_BUFFER_SIZE) {
+        output_flush();
+        write_all(STDOUT_FILENO, data, len);
+        return;
+    }
+    text_append(&output, data, len);
+    if (output.len >= OUTPUT_BUFFER_SIZE) {
+        output_flush();
+    }
+}
+
+long read_dents(int fd, char * buffer) {
+    return syscall(SYS_getdents64, fd, buffer, DENTS_BUFFER_SIZE);
+}
+
+/* Some filesystems leave d_type as DT_UNKNOWN; ask for the inode's type. */
+unsigned char resolve_type(int dir_fd, const char * name, unsigned char type) {
+    struct stat sb;
+    if (type != DT_UNKNOWN || fstatat(dir_fd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+        return type;
+    }
+    return IFTODT(sb.st_mode);
+}
+
+/*
+ * Serial walk.
+ * Subdirectories are opened relative to their parent's descriptor and read
+ * in bulk with getdents64 into one buffer per depth, reused by every
+ * directory at that depth, so listing an entry allocates nothing. The path
+ * is kept in a single growing buffer only so errors can name the directory.
+ */
+typedef struct {
+    char ** buffers;
+    int depth_cap;
+    char * path;
+    size_t path_len;
+    size_t path_cap;
+} WalkState;
+
+char * level_buffer(WalkState * state, int level) {
+    if (level >= state->depth_cap) {
+        int cap = state->depth_cap ? state->depth_cap * 2 : INITIAL_CAPACITY;
+        while (cap <= level) {
+            cap *= 2;
         }
+        state->buffers = xrealloc(state->buffers, cap * sizeof(char *));
+        memset(state->buffers + state->depth_cap, 0, (cap - state->depth_cap) * sizeof(char *));
+        state->depth_cap = cap;
     }
+    if (state->buffers[level] == NULL) {
+        state->buffers[level] = xrealloc(NULL, DENTS_BUFFER_SIZE);
+    }
+    return state->buffers[level];
+}
+
+/* Appends "/name" (or "name" after a trailing '/') and returns the old length. */
+size_t path_push(WalkState * state, const char * name) {
+    size_t saved = state->path_len;
+    size_t name_len = strlen(name);
+    if (state->path_len + name_len + 2 > state->path_cap) {
+        state->path_cap = (state->path_len + name_len + 2) * 2;
+        state->path = xrealloc(state->path, state->path_cap);
+    }
+    if (state->path_len == 0 || state->path[state->path_len - 1] != '/') {
+        state->path[state->path_len++] = '/';
+    }
+    memcpy(state->path + state->path_len, name, name_len + 1);
+    state->path_len += name_len;
+    return saved;
+}
+
+void path_pop(WalkState * state, size_t saved) {
+    state->path_len = saved;
+    state->path[saved] = '\0';
+}
+
+void walk_fd(WalkState * state, int fd, int level) {
+    char * buffer = level_buffer(state, level);
+    long nread;
+    while ((nread = read_dents(fd, buffer)) > 0) {
+        for (long offset = 0; offset < nread; ) {
+            LinuxDirent64 * entry = (LinuxDirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+            if (is_pwd_or_parent(entry->d_name)) {
+                continue;
+            }
+            if (!show_hidden && entry->d_name[0] == '.') {
+                continue;
+            }
+            unsigned char type = resolve_type(fd, entry->d_name, entry->d_type);
+            format_entry(&output, state->path, entry->d_name, type, level);
+            output_maybe_flush();
+            if (type == DT_DIR) {
+                size_t saved = path_push(state, entry->d_name);
+                int child = openat(fd, entry->d_name, OPEN_DIR_FLAGS);
+                if (child < 0) {
+                    output_flush();
+                    perror(state->path);
+                } else {
+                    walk_fd(state, child, level + 1);
+                    close(child);
+                }
+                path_pop(state, saved);
+            }
+        }
+    }
+    if (nread < 0) {
+        output_flush();
+        perror(state->path);
+    }
+}
+
+void walk_state_init(WalkState * state, const char * dir_name) {
+    memset(state, 0, sizeof(*state));
+    state->path_cap = strlen(dir_name) + 1;
+    state->path = xrealloc(NULL, state->path_cap);
+    memcpy(state->path, dir_name, state->path_cap);
+    state->path_len = state->path_cap - 1;
+}
+
+void walk_state_free(WalkState * state) {
+    for (int i = 0; i < state->depth_cap; i++) {
+        free(state->buffers[i]);
+    }
+    free(state->buffers);
+    free(state->path);
 }
 
 void walk_dir(const char * dir_name, int level) {
-    DIR * dir = opendir(dir_name);
-    if (dir == NULL) {
+    WalkState state;
+    walk_state_init(&state, dir_name);
+    int fd = open(dir_name, OPEN_DIR_FLAGS);
+    if (fd < 0) {
         perror(dir_name);
+    } else {
+        walk_fd(&state, fd, level);
+        close(fd);
+    }
+    output_flush();
+    walk_state_free(&state);
+}
+
+/*
+ * Parallel walk.
+ * Worker threads list directories into DirNodes: the formatted lines of the
+ * listing plus, for each subdirectory, the child node and the offset in the
+ * text where its listing belongs. New child nodes go on the bottom of the
+ * finding worker's deque; idle workers steal from the top of the others.
+ * The main thread prints the nodes depth-first, waiting for each to be
+ * listed, so the output is the same as walk_dir's for any worker count.
+ */
+typedef struct DirNode {
+    char * path;
+    int level;
+    int error;
+    int listed;
+    int hidden;     /* du: is or is below a hidden directory */
+    TextBuffer text;
+    uint64_t bytes;
+    uint64_t disk;
+    uint64_t files;
+    struct DirNode ** children;
+    size_t * child_offsets;
+    size_t num_children;
+    size_t children_cap;
+} DirNode;
+
+typedef struct {
+    DirNode ** items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+    pthread_mutex_t lock;
+} WorkDeque;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+} InodeKey;
+
+typedef struct {
+    InodeKey * keys;
+    size_t count;
+    size_t cap;
+    pthread_mutex_t lock;
+} InodeSet;
+
+typedef struct {
+    WorkDeque * deques;
+    int num_workers;
+    int started;
+    size_t pending;
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t node_listed;
+    InodeSet inodes;
+} Walker;
+
+typedef struct {
+    char * paths[LARGEST_ENTRIES];
+    uint64_t bytes[LARGEST_ENTRIES];
+    int count;
+} Largest;
+
+typedef struct {
+    Walker * walker;
+    int id;
+    Largest largest;
+} WorkerArgs;
+
+char * join_path(const char * dir_name, const char * name) {
+    size_t dir_len = strlen(dir_name);
+    size_t name_len = strlen(name);
+    char * path = xrealloc(NULL, dir_len + 1 + name_len + 1);
+    memcpy(path, dir_name, dir_len);
+    if (dir_len == 0 || dir_name[dir_len - 1] != '/') {
+        path[dir_len++] = '/';
+    }
+    memcpy(path + dir_len, name, name_len + 1);
+    return path;
+}
+
+DirNode * new_node(char * path, int level) {
+    DirNode * node = xrealloc(NULL, sizeof(DirNode));
+    memset(node, 0, sizeof(DirNode));
+    node->path = path;
+    node->level = level;
+    return node;
+}
+
+void free_node(DirNode * node) {
+    free(node->path);
+    free(node->text.data);
+    free(node->children);
+    free(node->child_offsets);
+    free(node);
+}
+
+void node_add_child(DirNode * node, DirNode * child) {
+    if (node->num_children == node->children_cap) {
+        node->children_cap = node->children_cap ? node->children_cap * 2 : INITIAL_CAPACITY;
+        node->children = xrealloc(node->children, node->children_cap * sizeof(DirNode *));
+        node->child_offsets = xrealloc(node->child_offsets, node->children_cap * sizeof(size_t));
+    }
+    node->children[node->num_children] = child;
+    node->child_offsets[node->num_children] = node->text.len;
+    node->num_children++;
+}
+
+void deque_push(WorkDeque * deque, DirNode * node) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->cap) {
+        size_t live = deque->tail - deque->head;
+        if (live * 2 > deque->cap || deque->cap == 0) {
+            deque->cap = deque->cap ? deque->cap * 2 : INITIAL_CAPACITY;
+            deque->items = xrealloc(deque->items, deque->cap * sizeof(DirNode *));
+        }
+        memmove(deque->items, deque->items + deque->head, live * sizeof(DirNode *));
+        deque->head = 0;
+        deque->tail = live;
+    }
+    deque->items[deque->tail++] = node;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/* The owner takes the newest node, keeping its own work depth-first. */
+DirNode * deque_pop(WorkDeque * deque) {
+    DirNode * node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        node = deque->items[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+/* Thieves take the oldest node, which tends to be the largest subtree. */
+DirNode * deque_steal(WorkDeque * deque) {
+    DirNode * node = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        node = deque->items[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return node;
+}
+
+/* Other workers may take the child as soon as it is queued, so set it up first. */
+DirNode * add_child(DirNode * node, const char * name) {
+    DirNode * child = new_node(join_path(node->path, name), node->level + 1);
+    node_add_child(node, child);
+    return child;
+}
+
+void queue_node(Walker * walker, int id, DirNode * node) {
+    pthread_mutex_lock(&walker->lock);
+    walker->pending++;
+    pthread_mutex_unlock(&walker->lock);
+    deque_push(&walker->deques[id], node);
+}
+
+void spawn_child(Walker * walker, int id, DirNode * node, const char * name) {
+    queue_node(walker, id, add_child(node, name));
+}
+
+void wake_workers(Walker * walker) {
+    pthread_mutex_lock(&walker->lock);
+    pthread_cond_broadcast(&walker->work_available);
+    pthread_mutex_unlock(&walker->lock);
+}
+
+/*
+ * Nodes are handed between threads, so each keeps its own path rather than
+ * a parent descriptor; the path is built once per directory, never per
+ * entry, and the entries are read with getdents64 into the worker's buffer.
+ */
+void list_node(Walker * walker, int id, DirNode * node, char * buffer) {
+    int fd = open(node->path, OPEN_DIR_FLAGS);
+    if (fd < 0) {
+        node->error = errno;
         return;
     }
-    struct dirent * entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (is_pwd_or_parent(entry->d_name)) {
-            continue;
+    size_t pushed = 0;
+    long nread;
+    while ((nread = read_dents(fd, buffer)) > 0) {
+        for (long offset = 0; offset < nread; ) {
+            LinuxDirent64 * entry = (LinuxDirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+            if (is_pwd_or_parent(entry->d_name)) {
+                continue;
+            }
+            if (!show_hidden && entry->d_name[0] == '.') {
+                continue;
+            }
+            unsigned char type = resolve_type(fd, entry->d_name, entry->d_type);
+            format_entry(&node->text, node->path, entry->d_name, type, node->level);
+            if (type == DT_DIR) {
+                spawn_child(walker, id, node, entry->d_name);
+                pushed++;
+            }
         }
-        if (!show_hidden && entry->d_name[0] == '.') {
-            continue;
+    }
+    if (nread < 0 && node->error == 0) {
+        node->error = errno;
+    }
+    close(fd);
+    if (pushed > 0) {
+        wake_workers(walker);
+    }
+}
+
+/*
+ * Disk usage.
+ * Each worker statx()es every entry of the directories it lists through the
+ * directory's descriptor, so metadata is fetched by all workers at once
+ * instead of one blocking stat at a time. Hidden entries always count
+ * toward the totals. Files with more than one link are counted only by
+ * whichever worker first adds their inode to the shared set; with several
+ * workers that decides which directory a hard-linked file is charged to,
+ * but not the total.
+ */
+int inode_set_add(InodeSet * set, uint64_t dev, uint64_t ino) {
+    pthread_mutex_lock(&set->lock);
+    if ((set->count + 1) * 2 > set->cap) {
+        size_t old_cap = set->cap;
+        InodeKey * old_keys = set->keys;
+        set->cap = old_cap ? old_cap * 2 : INITIAL_CAPACITY;
+        set->keys = xrealloc(NULL, set->cap * sizeof(InodeKey));
+        memset(set->keys, 0, set->cap * sizeof(InodeKey));
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old_keys[i].ino != 0) {
+                size_t slot = (old_keys[i].ino * 0x9e3779b97f4a7c15ULL ^ old_keys[i].dev) & (set->cap - 1);
+                while (set->keys[slot].ino != 0) {
+                    slot = (slot + 1) & (set->cap - 1);
+                }
+                set->keys[slot] = old_keys[i];
+            }
         }
-        size_t needed = strlen(dir_name) + 1 + strlen(entry->d_name) + 1;
-        char * path = malloc(needed);
-        if (path == NULL) {
-            perror("malloc");
-            closedir(dir);
+        free(old_keys);
+    }
+    size_t slot = (ino * 0x9e3779b97f4a7c15ULL ^ dev) & (set->cap - 1);
+    int added = 1;
+    for (; set->keys[slot].ino != 0; slot = (slot + 1) & (set->cap - 1)) {
+        if (set->keys[slot].ino == ino && set->keys[slot].dev == dev) {
+            added = 0;
+            break;
+        }
+    }
+    if (added) {
+        set->keys[slot].dev = dev;
+        set->keys[slot].ino = ino;
+        set->count++;
+    }
+    pthread_mutex_unlock(&set->lock);
+    return added;
+}
+
+/*
+ * Keeps a list of the largest files, biggest first and equal sizes by path,
+ * taking ownership of path. The order is total, so which worker saw a file
+ * does not change the merged result.
+ */
+void largest_insert(Largest * largest, char * path, uint64_t bytes) {
+    int last = LARGEST_ENTRIES - 1;
+    if (largest->count == LARGEST_ENTRIES) {
+        if (bytes < largest->bytes[last] || (bytes == largest->bytes[last] && strcmp(path, largest->paths[last]) >= 0)) {
+            free(path);
             return;
         }
-        if (dir_name[strlen(dir_name) - 1] == '/') {
-            snprintf(path, needed, "%s%s", dir_name, entry->d_name);
-        } else {
-            snprintf(path, needed, "%s/%s", dir_name, entry->d_name);
+        free(largest->paths[last]);
+    } else {
+        last = largest->count++;
+    }
+    int i = last;
+    for (; i > 0 && (largest->bytes[i - 1] < bytes ||
+                     (largest->bytes[i - 1] == bytes && strcmp(largest->paths[i - 1], path) > 0)); i--) {
+        largest->bytes[i] = largest->bytes[i - 1];
+        largest->paths[i] = largest->paths[i - 1];
+    }
+    largest->bytes[i] = bytes;
+    largest->paths[i] = path;
+}
+
+/* Builds the path only for files that can make the list. */
+void largest_add(Largest * largest, const DirNode * node, const char * name, uint64_t bytes) {
+    if (largest->count == LARGEST_ENTRIES && bytes < largest->bytes[LARGEST_ENTRIES - 1]) {
+        return;
+    }
+    largest_insert(largest, join_path(node->path, name), bytes);
+}
+
+void usage_list_node(WorkerArgs * args, DirNode * node, char * buffer) {
+    Walker * walker = args->walker;
+    int fd = open(node->path, OPEN_DIR_FLAGS);
+    if (fd < 0) {
+        node->error = errno;
+        return;
+    }
+    size_t pushed = 0;
+    long nread;
+    while ((nread = read_dents(fd, buffer)) > 0) {
+        for (long offset = 0; offset < nread; ) {
+            LinuxDirent64 * entry = (LinuxDirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+            if (is_pwd_or_parent(entry->d_name)) {
+                continue;
+            }
+            struct statx stx;
+            if (statx(fd, entry->d_name, STATX_FLAGS, STATX_FIELDS, &stx) < 0) {
+                fprintf(stderr, "%s%s%s: %s\n", node->path, node->path[strlen(node->path) - 1] == '/' ? "" : "/",
+                        entry->d_name, strerror(errno));
+                continue;
+            }
+            if (S_ISDIR(stx.stx_mode)) {
+                DirNode * child = add_child(node, entry->d_name);
+                child->hidden = node->hidden || entry->d_name[0] == '.';
+                child->bytes = stx.stx_size;
+                child->disk = stx.stx_blocks * 512;
+                queue_node(walker, args->id, child);
+                pushed++;
+                continue;
+            }
+            uint64_t dev = (uint64_t)stx.stx_dev_major << 32 | stx.stx_dev_minor;
+            if (stx.stx_nlink > 1 && !inode_set_add(&walker->inodes, dev, stx.stx_ino)) {
+                continue;
+            }
+            node->bytes += stx.stx_size;
+            node->disk += stx.stx_blocks * 512;
+            node->files++;
+            if (S_ISREG(stx.stx_mode) && (show_hidden || (!node->hidden && entry->d_name[0] != '.'))) {
+                largest_add(&args->largest, node, entry->d_name, stx.stx_size);
+            }
+        }
+    }
+    if (nread < 0 && node->error == 0) {
+        node->error = errno;
+    }
+    close(fd);
+    if (pushed > 0) {
+        wake_workers(walker);
+    }
+}
+
+DirNode * find_work(Walker * walker, int id) {
+    DirNode * node = deque_pop(&walker->deques[id]);
+    for (int i = 1; node == NULL && i < walker->num_workers; i++) {
+        node = deque_steal(&walker->deques[(id + i) % walker->num_workers]);
+    }
+    return node;
+}
+
+void * walk_worker(void * arg) {
+    WorkerArgs * args = arg;
+    Walker * walker = args->walker;
+    char * buffer = xrealloc(NULL, DENTS_BUFFER_SIZE);
+    for (;;) {
+        DirNode * node = find_work(walker, args->id);
+        if (node == NULL) {
+            pthread_mutex_lock(&walker->lock);
+            while (walker->pending > 0 && (node = find_work(walker, args->id)) == NULL) {
+                pthread_cond_wait(&walker->work_available, &walker->lock);
+            }
+            pthread_mutex_unlock(&walker->lock);
+            if (node == NULL) {
+                free(buffer);
+                return NULL;
+            }
         }
-        indent(level);
-        printf("%s", entry->d_name);
-        if (entry->d_type == DT_DIR) {
-           printf(":\n");
-           walk_dir(path, level + 1);
+        if (disk_usage) {
+            usage_list_node(args, node, buffer);
         } else {
-           printf("\n");
-       }
-        free(path);
+            list_node(walker, args->id, node, buffer);
+        }
+        pthread_mutex_lock(&walker->lock);
+        node->listed = 1;
+        walker->pending--;
+        pthread_cond_broadcast(&walker->node_listed);
+        if (walker->pending == 0) {
+            pthread_cond_broadcast(&walker->work_available);
+        }
+        pthread_mutex_unlock(&walker->lock);
+    }
+}
+
+void print_node(Walker * walker, DirNode * node) {
+    pthread_mutex_lock(&walker->lock);
+    while (!node->listed) {
+        pthread_cond_wait(&walker->node_listed, &walker->lock);
+    }
+    pthread_mutex_unlock(&walker->lock);
+    if (node->error != 0) {
+        output_flush();
+        fprintf(stderr, "%s: %s\n", node->path, strerror(node->error));
+    }
+    size_t printed = 0;
+    for (size_t i = 0; i < node->num_children; i++) {
+        output_write(node->text.data + printed, node->child_offsets[i] - printed);
+        printed = node->child_offsets[i];
+        print_node(walker, node->children[i]);
     }
-    closedir(dir);
+    output_write(node->text.data + printed, node->text.len - printed);
+    free_node(node);
+}
+
+DirNode * walker_start(Walker * walker, pthread_t * threads, WorkerArgs * args, const char * dir_name, int workers) {
+    memset(walker, 0, sizeof(*walker));
+    walker->num_workers = workers;
+    walker->deques = xrealloc(NULL, workers * sizeof(WorkDeque));
+    memset(walker->deques, 0, workers * sizeof(WorkDeque));
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_init(&walker->deques[i].lock, NULL);
+    }
+    pthread_mutex_init(&walker->lock, NULL);
+    pthread_cond_init(&walker->work_available, NULL);
+    pthread_cond_init(&walker->node_listed, NULL);
+    pthread_mutex_init(&walker->inodes.lock, NULL);
+
+    size_t len = strlen(dir_name);
+    char * root_path = xrealloc(NULL, len + 1);
+    memcpy(root_path, dir_name, len + 1);
+    DirNode * root = new_node(root_path, 0);
+    walker->pending = 1;
+    deque_push(&walker->deques[0], root);
+
+    for (; walker->started < workers; walker->started++) {
+        memset(&args[walker->started], 0, sizeof(WorkerArgs));
+        args[walker->started].walker = walker;
+        args[walker->started].id = walker->started;
+        if (pthread_create(&threads[walker->started], NULL, walk_worker, &args[walker->started]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    if (walker->started == 0) {
+        exit(EXIT_FAILURE);
+    }
+    return root;
+}
+
+void walker_finish(Walker * walker, pthread_t * threads) {
+    for (int i = 0; i < walker->started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < walker->num_workers; i++) {
+        pthread_mutex_destroy(&walker->deques[i].lock);
+        free(walker->deques[i].items);
+    }
+    free(walker->deques);
+    free(walker->inodes.keys);
+    pthread_mutex_destroy(&walker->inodes.lock);
+    pthread_cond_destroy(&walker->node_listed);
+    pthread_cond_destroy(&walker->work_available);
+    pthread_mutex_destroy(&walker->lock);
+}
+
+void walk_dir_parallel(const char * dir_name, int workers) {
+    Walker walker;
+    pthread_t threads[MAX_WORKERS];
+    WorkerArgs args[MAX_WORKERS];
+    DirNode * root = walker_start(&walker, threads, args, dir_name, workers);
+    print_node(&walker, root);
+    output_flush();
+    walker_finish(&walker, threads);
+}
+
+/* Adds each directory's subdirectories into its own counts. */
+void total_usage(DirNode * node) {
+    for (size_t i = 0; i < node->num_children; i++) {
+        total_usage(node->children[i]);
+        node->bytes += node->children[i]->bytes;
+        node->disk += node->children[i]->disk;
+        node->files += node->children[i]->files;
+    }
+}
+
+void format_size(char * buffer, size_t size, uint64_t bytes) {
+    static const char units[] = "KMGTPE";
+    if (bytes < 1024) {
+        snprintf(buffer, size, "%lluB", (unsigned long long)bytes);
+        return;
+    }
+    double value = bytes / 1024.0;
+    int unit = 0;
+    while (value >= 1024.0 && units[unit + 1] != '\0') {
+        value /= 1024.0;
+        unit++;
+    }
+    snprintf(buffer, size, "%.1f%c", value, units[unit]);
+}
+
+/*
+ * Prints directories depth-first, parents before children, then frees them.
+ * Hidden directories are counted but, without -l, not printed, and neither
+ * is anything below them.
+ */
+void print_usage(DirNode * node, int visible) {
+    char line[128];
+    char size[32];
+    if (node->error != 0) {
+        output_flush();
+        fprintf(stderr, "%s: %s\n", node->path, strerror(node->error));
+    }
+    const char * name = node->level == 0 ? node->path : strrchr(node->path, '/') + 1;
+    visible = visible && (node->level == 0 || show_hidden || name[0] != '.');
+    if (visible) {
+        switch (output_format) {
+        case FORMAT_TREE:
+            text_indent(&output, node->level);
+            text_append(&output, name, strlen(name));
+            format_size(size, sizeof(size), node->disk);
+            text_append(&output, line, snprintf(line, sizeof(line), ": %s in %llu file%s\n", size,
+                        (unsigned long long)node->files, node->files == 1 ? "" : "s"));
+            break;
+        case FORMAT_NUL:
+            text_append(&output, line, snprintf(line, sizeof(line), "%llu\t", (unsigned long long)node->disk));
+            text_append(&output, node->path, strlen(node->path) + 1);
+            break;
+        case FORMAT_JSON:
+            text_append(&output, "{\"path\":\"", 9);
+            text_json_escape(&output, node->path);
+            text_append(&output, line, snprintf(line, sizeof(line),
+                        "\",\"type\":\"directory\",\"depth\":%d,\"bytes\":%llu,\"disk\":%llu,\"files\":%llu}\n",
+                        node->level, (unsigned long long)node->bytes, (unsigned long long)node->disk,
+                        (unsigned long long)node->files));
+            break;
+        }
+        output_maybe_flush();
+    }
+    for (size_t i = 0; i < node->num_children; i++) {
+        print_usage(node->children[i], visible);
+    }
+    free_node(node);
+}
+
+/* Merges the workers' lists; largest_add's ordering makes them agree for any worker count. */
+void print_largest(WorkerArgs * args, int workers) {
+    Largest merged;
+    char line[128];
+    char size[32];
+    memset(&merged, 0, sizeof(merged));
+    for (int w = 0; w < workers; w++) {
+        for (int i = 0; i < args[w].largest.count; i++) {
+            largest_insert(&merged, args[w].largest.paths[i], args[w].largest.bytes[i]);
+        }
+    }
+    if (output_format == FORMAT_TREE && merged.count > 0) {
+        text_append(&output, "largest files:\n", 15);
+    }
+    for (int i = 0; i < merged.count; i++) {
+        switch (output_format) {
+        case FORMAT_TREE:
+            text_indent(&output, 1);
+            format_size(size, sizeof(size), merged.bytes[i]);
+            text_append(&output, line, snprintf(line, sizeof(line), "%s ", size));
+            text_append(&output, merged.paths[i], strlen(merged.paths[i]));
+            text_putc(&output, '\n');
+            break;
+        case FORMAT_NUL:
+            break;
+        case FORMAT_JSON:
+            text_append(&output, line, snprintf(line, sizeof(line), "{\"largest\":%d,\"path\":\"", i + 1));
+            text_json_escape(&output, merged.paths[i]);
+            text_append(&output, line, snprintf(line, sizeof(line), "\",\"type\":\"file\",\"bytes\":%llu}\n",
+                        (unsigned long long)merged.bytes[i]));
+            break;
+        }
+        free(merged.paths[i]);
+    }
+}
+
+/* Lists the cumulative usage of every directory under dir_name and the largest files. */
+void walk_dir_usage(const char * dir_name, int workers) {
+    struct statx stx;
+    if (statx(AT_FDCWD, dir_name, AT_NO_AUTOMOUNT, STATX_FIELDS, &stx) < 0) {
+        perror(dir_name);
+        return;
+    }
+    Walker walker;
+    pthread_t threads[MAX_WORKERS];
+    WorkerArgs args[MAX_WORKERS];
+    DirNode * root = walker_start(&walker, threads, args, dir_name, workers);
+    int started = walker.started;
+    walker_finish(&walker, threads);
+    root->bytes += stx.stx_size;
+    root->disk += stx.stx_blocks * 512;
+    total_usage(root);
+    print_usage(root, 1);
+    print_largest(args, started);
+    output_flush();
+}
+
+/*
+ * Snapshots.
+ * A snapshot file holds a header, then one record per directory in walk
+ * order (the root first), then every directory's entries contiguously, then
+ * the NUL-terminated names, starting with the root path. A rescan still
+ * fstats every directory, but reuses the mapped entries of any directory
+ * whose inode, mtime and ctime are unchanged, so only modified directories
+ * are read again. Each rescan builds the next snapshot as it goes.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t show_hidden;
+    uint32_t root_len;
+    uint64_t num_dirs;
+    uint64_t num_entries;
+    uint64_t names_size;
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t first_entry;
+    uint32_t num_entries;
+    int32_t error;
+} SnapshotDir;
+
+typedef struct {
+    uint64_t name_offset;
+    uint32_t name_len;
+    uint32_t child;
+    uint32_t type;
+    uint32_t reserved;
+} SnapshotEntry;
+
+typedef struct {
+    void * map;
+    size_t map_len;
+    const SnapshotDir * dirs;
+    const SnapshotEntry * entries;
+    const char * names;
+    size_t num_dirs;
+} Snapshot;
+
+typedef struct {
+    SnapshotDir * dirs;
+    size_t num_dirs;
+    size_t dirs_cap;
+    SnapshotEntry * entries;
+    size_t num_entries;
+    size_t entries_cap;
+    TextBuffer names;
+} SnapshotBuilder;
+
+/* Finds a changed directory's old entries by name. Slots hold index + 1. */
+typedef struct {
+    uint32_t * slots;
+    char * matched;
+    size_t mask;
+    uint64_t first;
+} NameTable;
+
+typedef struct {
+    const Snapshot * old;
+    SnapshotBuilder * next;
+    WalkState walk;
+    int list;
+    int changes;
+    int inotify_fd;
+    int watch_all;
+    int watch_failed;
+    time_t started;
+} Rescan;
+
+int snapshot_check(Snapshot * snap, const char * root) {
+    const SnapshotHeader * header = snap->map;
+    size_t len = snap->map_len - sizeof(SnapshotHeader);
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, 8) != 0 || header->show_hidden != (uint32_t)show_hidden) {
+        return 0;
+    }
+    if (header->num_dirs == 0 || header->num_dirs > len / sizeof(SnapshotDir)) {
+        return 0;
+    }
+    len -= header->num_dirs * sizeof(SnapshotDir);
+    if (header->num_entries > len / sizeof(SnapshotEntry)) {
+        return 0;
+    }
+    len -= header->num_entries * sizeof(SnapshotEntry);
+    if (header->names_size != len || header->root_len >= len) {
+        return 0;
+    }
+    snap->dirs = (const SnapshotDir *)(header + 1);
+    snap->entries = (const SnapshotEntry *)(snap->dirs + header->num_dirs);
+    snap->names = (const char *)(snap->entries + header->num_entries);
+    snap->num_dirs = header->num_dirs;
+    if (strlen(root) != header->root_len || memcmp(snap->names, root, header->root_len + 1) != 0) {
+        return 0;
+    }
+    /* Children must come after their parent, so a corrupt file cannot loop. */
+    for (size_t d = 0; d < header->num_dirs; d++) {
+        const SnapshotDir * dir = &snap->dirs[d];
+        if (dir->first_entry > header->num_entries || dir->num_entries > header->num_entries - dir->first_entry) {
+            return 0;
+        }
+        for (uint64_t e = dir->first_entry; e < dir->first_entry + dir->num_entries; e++) {
+            const SnapshotEntry * entry = &snap->entries[e];
+            if (entry->name_offset >= len || entry->name_len >= len - entry->name_offset ||
+                snap->names[entry->name_offset + entry->name_len] != '\0') {
+                return 0;
+            }
+            if (entry->child != NO_DIR && (entry->child <= d || entry->child >= header->num_dirs)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+void snapshot_unload(Snapshot * snap) {
+    if (snap->map != NULL) {
+        munmap(snap->map, snap->map_len);
+    }
+    memset(snap, 0, sizeof(*snap));
+}
+
+/* Leaves snap empty, so everything is rescanned, if the file is unusable. */
+void snapshot_load(Snapshot * snap, const char * file_name, const char * root) {
+    memset(snap, 0, sizeof(*snap));
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            perror(file_name);
+        }
+        return;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(SnapshotHeader)) {
+        fprintf(stderr, "%s: not a snapshot, rescanning\n", file_name);
+        close(fd);
+        return;
+    }
+    void * map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(file_name);
+        return;
+    }
+    snap->map = map;
+    snap->map_len = sb.st_size;
+    if (!snapshot_check(snap, root)) {
+        fprintf(stderr, "%s: snapshot does not match, rescanning\n", file_name);
+        snapshot_unload(snap);
+    }
+}
+
+void builder_init(SnapshotBuilder * builder, const char * root) {
+    memset(builder, 0, sizeof(*builder));
+    text_append(&builder->names, root, strlen(root) + 1);
+}
+
+void builder_free(SnapshotBuilder * builder) {
+    free(builder->dirs);
+    free(builder->entries);
+    free(builder->names.data);
+}
+
+/*
+ * A directory changed in the same second as the walk started could change
+ * again without its timestamps moving, so it is recorded as always stale.
+ */
+uint32_t builder_add_dir(SnapshotBuilder * builder, const struct stat * sb, time_t started) {
+    if (builder->num_dirs == builder->dirs_cap) {
+        builder->dirs_cap = builder->dirs_cap ? builder->dirs_cap * 2 : INITIAL_CAPACITY;
+        builder->dirs = xrealloc(builder->dirs, builder->dirs_cap * sizeof(SnapshotDir));
+    }
+    SnapshotDir * dir = &builder->dirs[builder->num_dirs];
+    memset(dir, 0, sizeof(*dir));
+    dir->dev = sb->st_dev;
+    dir->ino = sb->st_ino;
+    dir->mtime_sec = sb->st_mtim.tv_sec;
+    dir->mtime_nsec = sb->st_mtim.tv_nsec;
+    dir->ctime_sec = sb->st_ctim.tv_sec;
+    dir->ctime_nsec = sb->st_ctim.tv_nsec;
+    if (sb->st_mtim.tv_sec >= started || sb->st_ctim.tv_sec >= started) {
+        dir->mtime_nsec = -1;
+    }
+    dir->first_entry = builder->num_entries;
+    return builder->num_dirs++;
+}
+
+void builder_add_entry(SnapshotBuilder * builder, const char * name, size_t name_len, unsigned char type) {
+    if (builder->num_entries == builder->entries_cap) {
+        builder->entries_cap = builder->entries_cap ? builder->entries_cap * 2 : INITIAL_CAPACITY;
+        builder->entries = xrealloc(builder->entries, builder->entries_cap * sizeof(SnapshotEntry));
+    }
+    SnapshotEntry * entry = &builder->entries[builder->num_entries++];
+    memset(entry, 0, sizeof(*entry));
+    entry->name_offset = builder->names.len;
+    entry->name_len = name_len;
+    entry->child = NO_DIR;
+    entry->type = type;
+    text_append(&builder->names, name, name_len);
+    text_putc(&builder->names, '\0');
+}
+
+/* Written to a temporary name and renamed so readers never see a torn file. */
+int snapshot_save(const SnapshotBuilder * builder, const char * file_name) {
+    size_t length = strlen(file_name) + sizeof(".tmp");
+    char * temp_name = xrealloc(NULL, length);
+    snprintf(temp_name, length, "%s.tmp", file_name);
+    FILE * file = fopen(temp_name, "wb");
+    if (file == NULL) {
+        perror(temp_name);
+        free(temp_name);
+        return -1;
+    }
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.show_hidden = show_hidden;
+    header.root_len = strlen(builder->names.data);
+    header.num_dirs = builder->num_dirs;
+    header.num_entries = builder->num_entries;
+    header.names_size = builder->names.len;
+    int status = 0;
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(builder->dirs, sizeof(SnapshotDir), builder->num_dirs, file) != builder->num_dirs ||
+        fwrite(builder->entries, sizeof(SnapshotEntry), builder->num_entries, file) != builder->num_entries ||
+        fwrite(builder->names.data, 1, builder->names.len, file) != builder->names.len) {
+        status = -1;
+    }
+    if (fclose(file) != 0 || status != 0 || rename(temp_name, file_name) != 0) {
+        perror(file_name);
+        remove(temp_name);
+        status = -1;
+    }
+    free(temp_name);
+    return status;
+}
+
+uint64_t hash_name(const char * name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void name_table_init(NameTable * table, const Snapshot * snap, const SnapshotDir * dir) {
+    size_t cap = INITIAL_CAPACITY;
+    while (cap < (size_t)dir->num_entries * 2) {
+        cap *= 2;
+    }
+    table->slots = xrealloc(NULL, cap * sizeof(uint32_t));
+    memset(table->slots, 0, cap * sizeof(uint32_t));
+    table->matched = xrealloc(NULL, dir->num_entries + 1);
+    memset(table->matched, 0, dir->num_entries + 1);
+    table->mask = cap - 1;
+    table->first = dir->first_entry;
+    for (uint32_t i = 0; i < dir->num_entries; i++) {
+        const char * name = snap->names + snap->entries[dir->first_entry + i].name_offset;
+        size_t slot = hash_name(name) & table->mask;
+        while (table->slots[slot] != 0) {
+            slot = (slot + 1) & table->mask;
+        }
+        table->slots[slot] = i + 1;
+    }
+}
+
+/* Returns the old entry with this name and type and marks it seen, or NO_DIR. */
+uint64_t name_table_find(NameTable * table, const Snapshot * snap, const char * name, unsigned char type) {
+    for (size_t slot = hash_name(name) & table->mask; table->slots[slot] != 0; slot = (slot + 1) & table->mask) {
+        uint32_t i = table->slots[slot] - 1;
+        const SnapshotEntry * entry = &snap->entries[table->first + i];
+        if (entry->type == type && strcmp(snap->names + entry->name_offset, name) == 0) {
+            table->matched[i] = 1;
+            return table->first + i;
+        }
+    }
+    return NO_DIR;
+}
+
+void name_table_free(NameTable * table) {
+    free(table->slots);
+    free(table->matched);
+}
+
+void watch_dir(Rescan * rescan) {
+    if (inotify_add_watch(rescan->inotify_fd, rescan->walk.path, WATCH_MASK) < 0 && !rescan->watch_failed) {
+        output_flush();
+        perror(rescan->walk.path);
+        rescan->watch_failed = 1;
+    }
+}
+
+int read_entries(Rescan * rescan, int fd, int level) {
+    int dir_fd = openat(fd, ".", OPEN_DIR_FLAGS);
+    if (dir_fd < 0) {
+        return errno;
+    }
+    char * buffer = level_buffer(&rescan->walk, level);
+    long nread;
+    while ((nread = read_dents(dir_fd, buffer)) > 0) {
+        for (long offset = 0; offset < nread; ) {
+            LinuxDirent64 * entry = (LinuxDirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+            if (is_pwd_or_parent(entry->d_name)) {
+                continue;
+            }
+            if (!show_hidden && entry->d_name[0] == '.') {
+                continue;
+            }
+            builder_add_entry(rescan->next, entry->d_name, strlen(entry->d_name),
+                              resolve_type(dir_fd, entry->d_name, entry->d_type));
+        }
+    }
+    int error = nread < 0 ? errno : 0;
+    close(dir_fd);
+    return error;
+}
+
+void print_removed(Rescan * rescan, uint64_t old_entry, int level) {
+    const SnapshotEntry * entry = &rescan->old->entries[old_entry];
+    const char * name = rescan->old->names + entry->name_offset;
+    format_change(&output, '-', rescan->walk.path, name, entry->type, level);
+    output_maybe_flush();
+    if (entry->child != NO_DIR) {
+        const SnapshotDir * dir = &rescan->old->dirs[entry->child];
+        size_t saved = path_push(&rescan->walk, name);
+        for (uint32_t i = 0; i < dir->num_entries; i++) {
+            print_removed(rescan, dir->first_entry + i, level + 1);
+        }
+        path_pop(&rescan->walk, saved);
+    }
+}
+
+/*
+ * fd is an O_PATH descriptor for the directory at rescan->walk.path, and
+ * old_index its record in the old snapshot, if any. Returns its record in
+ * the next snapshot.
+ */
+uint32_t rescan_dir(Rescan * rescan, int fd, uint32_t old_index, int level) {
+    SnapshotBuilder * next = rescan->next;
+    const Snapshot * old_snap = rescan->old;
+    const SnapshotDir * old = old_index == NO_DIR ? NULL : &old_snap->dirs[old_index];
+    struct stat sb;
+    int error = 0;
+    if (fstat(fd, &sb) < 0) {
+        error = errno;
+        memset(&sb, 0, sizeof(sb));
+    }
+    int unchanged = old != NULL && error == 0 && old->error == 0 &&
+                    old->dev == (uint64_t)sb.st_dev && old->ino == (uint64_t)sb.st_ino &&
+                    old->mtime_sec == sb.st_mtim.tv_sec && old->mtime_nsec == sb.st_mtim.tv_nsec &&
+                    old->ctime_sec == sb.st_ctim.tv_sec && old->ctime_nsec == sb.st_ctim.tv_nsec;
+    if (rescan->inotify_fd >= 0 && error == 0 && (rescan->watch_all || !unchanged)) {
+        watch_dir(rescan);
+    }
+    uint32_t index = builder_add_dir(next, &sb, rescan->started);
+    size_t first = next->num_entries;
+    if (unchanged) {
+        for (uint32_t i = 0; i < old->num_entries; i++) {
+            const SnapshotEntry * entry = &old_snap->entries[old->first_entry + i];
+            builder_add_entry(next, old_snap->names + entry->name_offset, entry->name_len, entry->type);
+        }
+    } else if (error == 0) {
+        error = read_entries(rescan, fd, level);
+    }
+    if (error != 0) {
+        output_flush();
+        fprintf(stderr, "%s: %s\n", rescan->walk.path, strerror(error));
+    }
+    size_t count = next->num_entries - first;
+    next->dirs[index].error = error;
+    next->dirs[index].num_entries = count;
+
+    NameTable table;
+    int diffing = !unchanged && old != NULL;
+    if (diffing) {
+        name_table_init(&table, old_snap, old);
+    }
+    for (size_t i = 0; i < count; i++) {
+        SnapshotEntry entry = next->entries[first + i];
+        const char * name = next->names.data + entry.name_offset;
+        uint64_t old_entry = NO_DIR;
+        if (unchanged) {
+            old_entry = old->first_entry + i;
+        } else if (diffing) {
+            old_entry = name_table_find(&table, old_snap, name, entry.type);
+        }
+        if (rescan->list) {
+            format_entry(&output, rescan->walk.path, name, entry.type, level);
+        }
+        if (rescan->changes && old_entry == NO_DIR) {
+            format_change(&output, '+', rescan->walk.path, name, entry.type, level);
+        }
+        output_maybe_flush();
+        if (entry.type == DT_DIR) {
+            uint32_t old_child = old_entry == NO_DIR ? NO_DIR : old_snap->entries[old_entry].child;
+            size_t saved = path_push(&rescan->walk, name);
+            int child = openat(fd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child < 0) {
+                output_flush();
+                perror(rescan->walk.path);
+            } else {
+                uint32_t child_index = rescan_dir(rescan, child, old_child, level + 1);
+                next->entries[first + i].child = child_index;
+                close(child);
+            }
+            path_pop(&rescan->walk, saved);
+        }
+    }
+    if (diffing) {
+        for (uint32_t i = 0; rescan->changes && i < old->num_entries; i++) {
+            if (!table.matched[i]) {
+                print_removed(rescan, old->first_entry + i, level);
+            }
+        }
+        name_table_free(&table);
+    }
+    return index;
+}
+
+/*
+ * Blocks until inotify reports a change other than to the snapshot file
+ * itself, then waits for WATCH_SETTLE_MS of quiet so one rescan covers a
+ * burst of changes. Which directories changed does not matter, since the
+ * rescan finds them by their timestamps; that also makes a queue overflow
+ * harmless.
+ */
+void wait_for_changes(int inotify_fd, const char * snapshot_name) {
+    char buffer[INOTIFY_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char * base = strrchr(snapshot_name, '/');
+    base = base == NULL ? snapshot_name : base + 1;
+    size_t base_len = strlen(base);
+    int relevant = 0;
+    while (!relevant) {
+        ssize_t nread = read(inotify_fd, buffer, sizeof(buffer));
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("inotify");
+            exit(EXIT_FAILURE);
+        }
+        for (char * p = buffer; p < buffer + nread; ) {
+            struct inotify_event * event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0 || strncmp(event->name, base, base_len) != 0 ||
+                (event->name[base_len] != '\0' && strcmp(event->name + base_len, ".tmp") != 0)) {
+                relevant = 1;
+            }
+        }
+    }
+    struct pollfd pfd = {inotify_fd, POLLIN, 0};
+    while (poll(&pfd, 1, WATCH_SETTLE_MS) > 0) {
+        if (read(inotify_fd, buffer, sizeof(buffer)) < 0 && errno != EINTR) {
+            perror("inotify");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Lists dir_name, reusing and then replacing the snapshot in file_name. In
+ * watch mode it then waits for changes and prints only the entries added
+ * and removed by each, until interrupted.
+ */
+void walk_dir_snapshot(const char * dir_name, const char * file_name, int watch) {
+    Snapshot old;
+    SnapshotBuilder next;
+    Rescan rescan;
+    memset(&rescan, 0, sizeof(rescan));
+    walk_state_init(&rescan.walk, dir_name);
+    rescan.inotify_fd = -1;
+    if (watch) {
+        rescan.inotify_fd = inotify_init1(IN_CLOEXEC);
+        if (rescan.inotify_fd < 0) {
+            perror("inotify_init1");
+            exit(EXIT_FAILURE);
+        }
+    }
+    rescan.list = 1;
+    rescan.watch_all = watch;
+    snapshot_load(&old, file_name, dir_name);
+    for (;;) {
+        int fd = open(dir_name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            output_flush();
+            perror(dir_name);
+            break;
+        }
+        builder_init(&next, dir_name);
+        rescan.old = &old;
+        rescan.next = &next;
+        rescan.started = time(NULL);
+        rescan_dir(&rescan, fd, old.num_dirs > 0 ? 0 : NO_DIR, 0);
+        close(fd);
+        output_flush();
+        snapshot_save(&next, file_name);
+        builder_free(&next);
+        snapshot_unload(&old);
+        if (!watch) {
+            break;
+        }
+        wait_for_changes(rescan.inotify_fd, file_name);
+        snapshot_load(&old, file_name, dir_name);
+        rescan.list = 0;
+        rescan.changes = 1;
+        rescan.watch_all = 0;
+    }
+    snapshot_unload(&old);
+    if (rescan.inotify_fd >= 0) {
+        close(rescan.inotify_fd);
+    }
+    walk_state_free(&rescan.walk);
+}
+
+void usage(const char * program) {
+    fprintf(stderr, "Usage: %s directory [-l] [-u] [-j workers] [-f tree|nul|json] [-s snapshot [-w]]\n", program);
 }
 
 int main(int argc, char * argv[]) {
     if (argc < 2) {
         return 0;
     }
-    if (argc > 2 && strcmp(argv[2], "-l") == 0) {
-        show_hidden = 1;
+    const char * snapshot_name = NULL;
+    int watch = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "luj:f:s:w")) != -1) {
+        switch (opt) {
+        case 'l':
+            show_hidden = 1;
+            break;
+        case 'u':
+            disk_usage = 1;
+            break;
+        case 'j':
+            num_workers = atoi(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "tree") == 0) {
+                output_format = FORMAT_TREE;
+            } else if (strcmp(optarg, "nul") == 0) {
+                output_format = FORMAT_NUL;
+            } else if (strcmp(optarg, "json") == 0) {
+                output_format = FORMAT_JSON;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            snapshot_name = optarg;
+            break;
+        case 'w':
+            watch = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || num_workers < 1 || num_workers > MAX_WORKERS || (watch && snapshot_name == NULL) ||
+        (disk_usage && snapshot_name != NULL)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    memset(indent_cache, ' ', sizeof(indent_cache));
+    if (disk_usage) {
+        walk_dir_usage(argv[optind], num_workers);
+    } else if (snapshot_name != NULL) {
+        walk_dir_snapshot(argv[optind], snapshot_name, watch);
+    } else if (num_workers == 1) {
+        walk_dir(argv[optind], 0);
+    } else {
+        walk_dir_parallel(argv[optind], num_workers);
     }
-    walk_dir(argv[1], 0);
     return 0;
-}
\ No newline at end of file
+}